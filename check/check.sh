@@ -0,0 +1,187 @@
+#!/bin/sh
+#
+# check.sh: moonroot's regression tests, run by "make check".
+#
+#   check/check.sh offscreen   draw each moon in check/budgets with -o
+#                              and compare it with its golden image
+#   check/check.sh x           the same, drawn in a window on a private
+#                              Xvfb; skipped if there's no Xvfb
+#   check/check.sh goldens [-f] [mode [size]]
+#                              draw the missing golden images, of every
+#                              line or just those of that mode and size;
+#                              -f draws existing ones again too, only
+#                              for when a change to the drawing is meant
+#
+# A moon that differs from its golden image, or takes longer offscreen
+# than check/budgets allows, fails, and so does a golden image that's
+# missing: the exit status is 1 if anything failed.
+#
+# Copyright 2004 by Akkana Peck.
+# You are free to use or modify this code under the Gnu Public License.
+
+MOONROOT=${MOONROOT:-./moonroot}
+BUDGETS=${BUDGETS:-check/budgets}
+GOLDEN=${GOLDEN:-check/golden}
+BENCH=${BENCH:-20}
+
+failures=0
+xvfb=
+tmp=
+
+fail()
+{
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# Start a private Xvfb, and point DISPLAY at it.
+start_xvfb()
+{
+    tmp=$(mktemp -d) || return 1
+    Xvfb -displayfd 3 -screen 0 1024x768x24 -nolisten tcp \
+        3> "$tmp/display" 2> "$tmp/xvfb.log" &
+    xvfb=$!
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20
+    do
+        if [ -s "$tmp/display" ]
+        then
+            DISPLAY=:$(cat "$tmp/display")
+            export DISPLAY
+            return 0
+        fi
+        sleep .25
+    done
+    fail "Xvfb didn't start:"
+    cat "$tmp/xvfb.log"
+    return 1
+}
+
+stop_xvfb()
+{
+    [ -n "$xvfb" ] && kill "$xvfb" 2> /dev/null
+    [ -n "$tmp" ] && rm -rf "$tmp"
+    xvfb=
+    tmp=
+}
+trap stop_xvfb EXIT
+
+have_xvfb()
+{
+    command -v Xvfb > /dev/null 2>&1
+}
+
+# One line of check/budgets, drawn offscreen or in a window.
+check_moon()
+{
+    where=$1 mode=$2 size=$3 at=$4 tol=$5 cpu=$6
+    golden=$GOLDEN/$mode-$size-$at.png
+
+    if [ "$where" = offscreen ] && [ "$cpu" = - ]
+    then
+        return
+    fi
+    if [ ! -f "$golden" ]
+    then
+        fail "$golden is missing: see check/budgets"
+        return
+    fi
+    if [ "$where" = offscreen ]
+    then
+        "$MOONROOT" -compare "$golden" -at "$at" -size "$size" \
+            -render "$mode" -tolerance "$tol" -bench "$BENCH" \
+            -budget "$cpu" ||
+            fail "$mode $size at $at, offscreen"
+    else
+        "$MOONROOT" -compare "$golden" -window -at "$at" -size "$size" \
+            -render "$mode" -tolerance "$tol" -bench "$BENCH" ||
+            fail "$mode $size at $at, in a window"
+    fi
+}
+
+# Draw the golden image for one line, if it's one asked for: offscreen
+# if it can be.
+draw_golden()
+{
+    mode=$1 size=$2 at=$3 cpu=$5
+    golden=$GOLDEN/$mode-$size-$at.png
+
+    if [ -n "$want_mode" ] && [ "$mode" != "$want_mode" ]
+    then
+        return
+    fi
+    if [ -n "$want_size" ] && [ "$size" != "$want_size" ]
+    then
+        return
+    fi
+    if [ -f "$golden" ] && [ -z "$force" ]
+    then
+        echo "$golden is there already: -f to draw it again"
+        return
+    fi
+    if [ "$cpu" = - ]
+    then
+        if [ -z "$xvfb" ]
+        then
+            if ! have_xvfb
+            then
+                fail "$golden needs Xvfb"
+                return
+            fi
+            start_xvfb || return
+        fi
+        "$MOONROOT" -o "$golden" -window -at "$at" -size "$size" \
+            -render "$mode"
+    else
+        "$MOONROOT" -o "$golden" -at "$at" -size "$size" -render "$mode"
+    fi && echo "$golden" || fail "can't draw $golden"
+}
+
+# Run a command on each line of check/budgets, in this shell.
+each_moon()
+{
+    moons=$(mktemp) || exit 1
+    grep -v '^#' "$BUDGETS" > "$moons"
+    while read -r line
+    do
+        [ -n "$line" ] && "$@" $line
+    done < "$moons"
+    rm -f "$moons"
+}
+
+case $1 in
+    offscreen)
+        each_moon check_moon offscreen
+        ;;
+    x)
+        if ! have_xvfb
+        then
+            echo "No Xvfb: skipping the window pass."
+            exit 0
+        fi
+        start_xvfb && each_moon check_moon x
+        ;;
+    goldens)
+        shift
+        force=
+        if [ "$1" = -f ]
+        then
+            force=1
+            shift
+        fi
+        want_mode=$1 want_size=$2
+        mkdir -p "$GOLDEN"
+        each_moon draw_golden
+        ;;
+    *)
+        echo "Usage: $0 offscreen|x|goldens [-f] [mode [size]]" >&2
+        exit 2
+        ;;
+esac
+
+if [ "$failures" -eq 0 ]
+then
+    echo "All moons passed."
+    exit 0
+fi
+echo "$failures failed."
+exit 1
@@ -0,0 +1,370 @@
+/*
+ * moonanim.c: -animate, the phases going by at a steady frame rate.
+ *
+ * A producer thread shades the coming frames into a ring of server
+ * pixmaps, and a timer on the window's event loop shows each when its
+ * time comes, with a single XCopyArea.  The producer draws through
+ * the window's own connection (hence XInitThreads), so its puts and
+ * the loop's copies reach the server in the order they're made.
+ *
+ * A frame that isn't ready when it's due is dropped: the window keeps
+ * the last one and the producer skips ahead to catch up.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+#include "moonpixel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+/* How many frames the producer can get ahead */
+#define ANIM_RING 8
+
+typedef struct {
+    Pixmap pix;
+    long frame;             /* the frame in it, or -1 */
+    int ready;              /* drawn, and not being drawn over */
+} AnimSlot;
+
+struct AnimState {
+    MoonContext* producer;  /* the producer's GC, image and caches */
+    double secsPerLunation;
+    int fps;
+    int timer;
+    double start;           /* StatsClock when frame 0 was due */
+    time_t base;            /* the date frame 0 shows */
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    AnimSlot ring[ANIM_RING];
+    long shown;             /* the last frame due, shown or dropped */
+    int stopping;
+    pthread_t thread;
+    int running;
+    int paused;
+    double pausedAt;
+
+    /* For the report when the window goes */
+    unsigned long presented, dropped;
+    double lastPresent, intervalSum, intervalSquares, intervalMax;
+};
+
+/* The date frame n shows */
+static time_t FrameDate(struct AnimState* as, long n)
+{
+    return as->base
+        + (time_t)(n * (double)LUNATION / (as->secsPerLunation * as->fps));
+}
+
+/* Shade the moon for date into pix.  Runs on the producer thread.
+ * Returns 0 on success.
+ */
+static int ShadeFrame(MoonContext* pc, Pixmap pix, time_t date)
+{
+    const unsigned int* argb = GetMoonARGB(pc, pc->diam);
+    double sun[3];
+
+    if (!argb)
+        return -1;
+    if (!pc->shade && !(pc->shade = NewShadeCache()))
+        return -1;
+    GetSunDirection(date, sun);
+    if (pc->renderMode == RENDER_AA)
+        ShadeMoonAA(pc->shade, argb, pc->diam, sun, pc->earthshine,
+                    &pc->shadeFormat, (unsigned int*)pc->shadeImage->data);
+    else
+        ShadeMoon(pc->shade, argb, pc->diam, sun, pc->earthshine,
+                  &pc->shadeFormat, (unsigned int*)pc->shadeImage->data);
+    PutShadeImage(pc, pix, pc->shadeImage);
+    return 0;
+}
+
+/* Fill the ring ahead of the frame that's due, until told to stop. */
+static void* Producer(void* data)
+{
+    struct AnimState* as = data;
+    long next = 0;
+
+    pthread_mutex_lock(&as->lock);
+    while (!as->stopping)
+    {
+        long n = next > as->shown ? next : as->shown + 1;
+        AnimSlot* slot = &as->ring[n % ANIM_RING];
+        int ok;
+
+        /* Its frame is still to be shown: the ring is full */
+        if (slot->frame > as->shown)
+        {
+            pthread_cond_wait(&as->changed, &as->lock);
+            continue;
+        }
+        slot->frame = n;
+        slot->ready = 0;
+        pthread_mutex_unlock(&as->lock);
+
+        ok = ShadeFrame(as->producer, slot->pix, FrameDate(as, n)) == 0;
+        XFlush(as->producer->dpy);
+
+        pthread_mutex_lock(&as->lock);
+        if (!ok)
+        {
+            fprintf(stderr, "moonroot: can't draw animation frames\n");
+            break;
+        }
+        slot->ready = 1;
+        next = n + 1;
+    }
+    pthread_mutex_unlock(&as->lock);
+    return 0;
+}
+
+/* Show the frame that's due, if it's ready. */
+static void AnimTick(int fd, void* data)
+{
+    MoonContext* ctx = data;
+    struct AnimState* as = ctx->anim;
+    double now = StatsClock();
+    long due = (long)((now - as->start) * as->fps / 1e6);
+    AnimSlot* slot = &as->ring[due % ANIM_RING];
+    int ready;
+
+    ReadTimer(fd);
+    if (due <= as->shown)
+        return;
+
+    pthread_mutex_lock(&as->lock);
+    ready = slot->frame == due && slot->ready;
+    pthread_mutex_unlock(&as->lock);
+
+    /* The producer won't draw over the slot until shown moves past it */
+    if (ready)
+    {
+        XCopyArea(ctx->dpy, slot->pix, ctx->win, ctx->gc, 0, 0,
+                  ctx->diam, ctx->diam, ctx->moonX, ctx->moonY);
+        XFlush(ctx->dpy);
+        StatsRecord(STAT_FRAME_LATE_US,
+                    now - as->start - due * 1e6 / as->fps);
+        StatsRecord(STAT_FRAMES_DROPPED, due - as->shown - 1);
+        if (as->presented++)
+        {
+            double interval = now - as->lastPresent;
+
+            as->intervalSum += interval;
+            as->intervalSquares += interval * interval;
+            if (interval > as->intervalMax)
+                as->intervalMax = interval;
+        }
+        as->lastPresent = now;
+        as->dropped += due - as->shown - 1;
+    }
+    else
+        as->dropped += due - as->shown;
+
+    pthread_mutex_lock(&as->lock);
+    as->shown = due;
+    pthread_cond_broadcast(&as->changed);
+    pthread_mutex_unlock(&as->lock);
+}
+
+/* Stop the producer and free the ring and the producer's context. */
+static void StopProducer(struct AnimState* as)
+{
+    MoonContext* pc = as->producer;
+    int i;
+
+    if (as->running)
+    {
+        pthread_mutex_lock(&as->lock);
+        as->stopping = 1;
+        pthread_cond_broadcast(&as->changed);
+        pthread_mutex_unlock(&as->lock);
+        pthread_join(as->thread, 0);
+        as->running = 0;
+    }
+    for (i = 0; i < ANIM_RING; ++i)
+    {
+        if (as->ring[i].pix != None)
+            XFreePixmap(pc->dpy, as->ring[i].pix);
+        as->ring[i].pix = None;
+        as->ring[i].frame = -1;
+        as->ring[i].ready = 0;
+    }
+    if (pc->shadeImage)
+        DestroyShadeImage(pc, pc->shadeImage);
+    FreeShmState(pc);
+    FreeImageState(pc);
+    FreeShadeCache(pc->shade);
+    if (pc->gc)
+        XFreeGC(pc->dpy, pc->gc);
+    free(pc);
+    as->producer = 0;
+}
+
+/* Make the ring at the window's size and start filling it.
+ * Returns 0 on success.
+ */
+static int StartProducer(MoonContext* ctx, struct AnimState* as)
+{
+    MoonContext* pc = calloc(1, sizeof *pc);
+    int i;
+
+    if (!pc)
+        return -1;
+    as->producer = pc;
+    pc->dpy = ctx->dpy;
+    pc->screen = ctx->screen;
+    pc->visual = ctx->visual;
+    pc->depth = ctx->depth;
+    pc->diam = ctx->diam;
+    pc->earthshine = ctx->earthshine;
+    pc->renderMode = ctx->renderMode == RENDER_AA ? RENDER_AA : RENDER_SHADE;
+    GetPixelFormat(pc->visual, pc->depth, &pc->shadeFormat);
+
+    /* Shared memory completions would come to the window's loop, not
+     * the producer, so it sends the pixels down the connection.
+     */
+    pc->useShm = 0;
+    pc->gc = XCreateGC(pc->dpy, ctx->win, 0, 0);
+    pc->shadeImage = CreateShadeImage(pc);
+    if (!pc->shadeImage || !IsNativeWords(pc->shadeImage))
+    {
+        StopProducer(as);
+        return -1;
+    }
+    for (i = 0; i < ANIM_RING; ++i)
+        as->ring[i].pix = XCreatePixmap(pc->dpy, ctx->win, pc->diam,
+                                        pc->diam, pc->depth);
+
+    as->stopping = 0;
+    if (pthread_create(&as->thread, 0, Producer, as) != 0)
+    {
+        StopProducer(as);
+        return -1;
+    }
+    as->running = 1;
+    return 0;
+}
+
+/* Play a lunation every secsPerLunation seconds, at fps frames a
+ * second, in ctx's window.  Call from the thread whose loop runs the
+ * window, with Xlib initialized for threads.  Returns 0 on success.
+ */
+int StartAnimation(MoonContext* ctx, double secsPerLunation, int fps)
+{
+    struct AnimState* as;
+
+    if (ctx->visual->class != TrueColor)
+    {
+        fprintf(stderr, "moonroot: can't animate on this visual\n");
+        return -1;
+    }
+    as = calloc(1, sizeof *as);
+    if (!as)
+        return -1;
+    as->secsPerLunation = secsPerLunation;
+    as->fps = fps;
+    as->start = StatsClock();
+    as->base = MoonTime(ctx);
+    pthread_mutex_init(&as->lock, 0);
+    pthread_cond_init(&as->changed, 0);
+
+    as->timer = CreateTimer(AnimTick, ctx);
+    if (as->timer < 0 || StartProducer(ctx, as) != 0)
+    {
+        if (as->timer >= 0)
+        {
+            UnwatchFd(as->timer);
+            close(as->timer);
+        }
+        pthread_mutex_destroy(&as->lock);
+        pthread_cond_destroy(&as->changed);
+        free(as);
+        return -1;
+    }
+    ctx->anim = as;
+
+    /* Frame 0 is due now, with nothing drawn: start with frame 1 */
+    SetTimerUs(as->timer, 1000000UL / fps, 1000000UL / fps);
+    return 0;
+}
+
+/* The window's size or time changed: draw the frames again from the
+ * one due next, from the current time if fromNow.
+ */
+void RestartAnimation(MoonContext* ctx, int fromNow)
+{
+    struct AnimState* as = ctx->anim;
+
+    if (!as)
+        return;
+    StopProducer(as);
+    if (fromNow)
+        as->base = MoonTime(ctx) - (FrameDate(as, as->shown) - as->base);
+    if (StartProducer(ctx, as) != 0)
+        fprintf(stderr, "moonroot: can't restart the animation\n");
+}
+
+/* Stop showing frames while the window can't be seen, or go on
+ * from the frame after the last one shown.  The producer stops by
+ * itself once the ring is full.
+ */
+void PauseAnimation(MoonContext* ctx, int paused)
+{
+    struct AnimState* as = ctx->anim;
+    unsigned long period;
+    double now, next;
+
+    if (!as || paused == as->paused)
+        return;
+    as->paused = paused;
+    now = StatsClock();
+    if (paused)
+    {
+        as->pausedAt = now;
+        SetTimerUs(as->timer, 0, 0);
+        return;
+    }
+
+    /* The time away doesn't count, for the frames or for jitter */
+    as->start += now - as->pausedAt;
+    as->lastPresent += now - as->pausedAt;
+    period = 1000000UL / as->fps;
+    next = as->start + (as->shown + 1) * 1e6 / as->fps - now;
+    SetTimerUs(as->timer, next >= 1. ? (unsigned long)next : 1, period);
+}
+
+/* Stop, and report how smooth it was. */
+void StopAnimation(MoonContext* ctx)
+{
+    struct AnimState* as = ctx->anim;
+
+    if (!as)
+        return;
+    if (as->producer)
+        StopProducer(as);
+    UnwatchFd(as->timer);
+    close(as->timer);
+
+    if (as->presented > 1)
+    {
+        double n = as->presented - 1;
+        double mean = as->intervalSum / n;
+        double var = as->intervalSquares / n - mean * mean;
+
+        fprintf(stderr, "Animation: %lu frames shown, %lu dropped; "
+                "frame time %.2f ms, jitter %.2f ms, worst %.2f ms\n",
+                as->presented, as->dropped, mean / 1e3,
+                var > 0. ? sqrt(var) / 1e3 : 0., as->intervalMax / 1e3);
+    }
+    pthread_mutex_destroy(&as->lock);
+    pthread_cond_destroy(&as->changed);
+    free(as);
+    ctx->anim = 0;
+}
@@ -0,0 +1,529 @@
+/*
+ * moonbench.c: how long after an event moonroot's window is drawn,
+ * end to end, as someone looking at the screen would see it.
+ *
+ * It starts an Xvfb and a moonroot on it (or, with -display, uses a
+ * server that's already running one), then, from a connection of its
+ * own, times each kind of event until the window has been drawn:
+ *
+ *   expose  XClearArea with exposures on: a real Expose
+ *   map     unmap the window and map it again
+ *   resize  XResizeWindow, alternately larger and back
+ *   drag    a button press, a motion and a release, timed until the
+ *           window has moved
+ *
+ * The window's background is set to a colour the moon never is, so
+ * until moonroot draws, its middle is that colour: GetImage of the
+ * middle pixel, over and over, says when the draw reached the screen.
+ * Each GetImage is a round trip, which is also what orders it after
+ * the event that started the clock.
+ *
+ * There's no XTest here: the Expose, map and resize are the real
+ * thing, and the drag events are sent with XSendEvent, which moonroot
+ * handles just the same.
+ *
+ * The moonroot it starts gets a control socket, so after the resizes
+ * it can ask how many times the moon was resampled for them.  A
+ * window keeps only the moon it shows, so going back to a size
+ * resamples it again unless it's one built in.
+ *
+ * Not built by default: "make moonbench".  It needs Xvfb in $PATH.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#define TIMEOUT_US 2000000.
+#define MAX_ARGS 32
+
+/* moonroot waits this long for a drag-resize to settle; let it,
+ * between resizes, so each one starts from a drawn window.
+ */
+#define RESIZE_SETTLE_US 150000
+
+static unsigned long marker;
+
+/* moonroot's control socket, if we know it */
+static char controlPath[sizeof ((struct sockaddr_un*)0)->sun_path];
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* GetImage of a window that's just been unmapped is a BadMatch:
+ * that's only a failed poll, so don't let Xlib exit over it.
+ */
+static int IgnoreErrors(Display* d, XErrorEvent* err)
+{
+    return 0;
+}
+
+/* Start an Xvfb on a free display, and put its name in name.
+ * Returns its pid, or -1.
+ */
+static pid_t StartXvfb(const char* screen, char* name, size_t len)
+{
+    int fds[2];
+    char buf[16];
+    ssize_t n;
+    pid_t pid;
+
+    if (pipe(fds) != 0)
+        return -1;
+    pid = fork();
+    if (pid == 0)
+    {
+        char fdarg[16];
+
+        close(fds[0]);
+        snprintf(fdarg, sizeof fdarg, "%d", fds[1]);
+        execlp("Xvfb", "Xvfb", "-displayfd", fdarg, "-screen", "0", screen,
+               "-nolisten", "tcp", (char*)0);
+        perror("Xvfb");
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        return -1;
+    }
+
+    /* Xvfb writes the display number there once it's listening */
+    n = read(fds[0], buf, sizeof buf - 1);
+    close(fds[0]);
+    if (n <= 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, 0, 0);
+        return -1;
+    }
+    buf[n] = '\0';
+    snprintf(name, len, ":%d", atoi(buf));
+    return pid;
+}
+
+/* Run moonroot on display name, with args.  It puts itself in the
+ * background, so this returns once it has.  Returns 0 on success.
+ */
+static int StartMoonroot(const char* path, const char* name,
+                         char** args, int nargs)
+{
+    char* argv[MAX_ARGS + 6];
+    int i, n = 3, status;
+    pid_t pid;
+
+    argv[0] = (char*)path;
+    argv[1] = "-display";
+    argv[2] = (char*)name;
+    if (*controlPath)
+    {
+        argv[n++] = "-control";
+        argv[n++] = controlPath;
+    }
+    for (i = 0; i < nargs; ++i)
+        argv[n++] = args[i];
+    argv[n] = 0;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        execv(path, argv);
+        perror(path);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* moonroot's window: class MoonRoot, anywhere under w. */
+static Window FindMoonWindow(Display* d, Window w)
+{
+    Window root, parent, *children;
+    unsigned int n, i;
+    XClassHint hint;
+    Window found = None;
+
+    if (XGetClassHint(d, w, &hint))
+    {
+        if (hint.res_class && !strcmp(hint.res_class, "MoonRoot"))
+            found = w;
+        XFree(hint.res_name);
+        XFree(hint.res_class);
+        if (found)
+            return found;
+    }
+    if (!XQueryTree(d, w, &root, &parent, &children, &n))
+        return None;
+    for (i = 0; i < n && !found; ++i)
+        found = FindMoonWindow(d, children[i]);
+    if (children)
+        XFree(children);
+    return found;
+}
+
+/* Poll the pixel at x, y until it isn't the marker.
+ * Returns how long after start that was, in microseconds, or -1.
+ */
+static double WaitForDraw(Display* d, Window w, int x, int y, double start)
+{
+    while (Now() - start < TIMEOUT_US)
+    {
+        XImage* img = XGetImage(d, w, x, y, 1, 1, AllPlanes, ZPixmap);
+
+        if (img)
+        {
+            unsigned long pixel = XGetPixel(img, 0, 0);
+            XDestroyImage(img);
+            if (pixel != marker)
+                return Now() - start;
+        }
+    }
+    return -1.;
+}
+
+/* Poll the window's position until it isn't at x, y.
+ * Returns how long after start that was, in microseconds, or -1.
+ */
+static double WaitForMove(Display* d, Window w, int x, int y, double start)
+{
+    Window child;
+    int nx, ny;
+
+    while (Now() - start < TIMEOUT_US)
+    {
+        XTranslateCoordinates(d, w, DefaultRootWindow(d), 0, 0,
+                              &nx, &ny, &child);
+        if (nx != x || ny != y)
+            return Now() - start;
+    }
+    return -1.;
+}
+
+/* How many times moonroot has resampled the moon, by its control
+ * socket, or -1 if it can't say.
+ */
+static int Resamples()
+{
+    struct sockaddr_un addr;
+    char reply[64];
+    size_t got = 0;
+    ssize_t n;
+    int fd, count = -1;
+
+    if (!*controlPath)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, controlPath);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0
+        || write(fd, "resamples\n", 10) != 10)
+    {
+        close(fd);
+        return -1;
+    }
+    while (got < sizeof reply - 1
+           && (n = read(fd, reply + got, sizeof reply - 1 - got)) > 0)
+    {
+        got += n;
+        if (memchr(reply, '\n', got))
+            break;
+    }
+    reply[got] = '\0';
+    close(fd);
+    if (sscanf(reply, "ok resamples %d", &count) != 1)
+        return -1;
+    return count;
+}
+
+static int Size(Display* d, Window w)
+{
+    XWindowAttributes attrs;
+
+    if (!XGetWindowAttributes(d, w, &attrs))
+        return 0;
+    return attrs.width < attrs.height ? attrs.width : attrs.height;
+}
+
+static double TimeExpose(Display* d, Window w, int i)
+{
+    int size = Size(d, w);
+    double start = Now();
+
+    XClearArea(d, w, 0, 0, 0, 0, True);
+    XSync(d, False);
+    return WaitForDraw(d, w, size / 2, size / 2, start);
+}
+
+static double TimeMap(Display* d, Window w, int i)
+{
+    int size = Size(d, w);
+    double start;
+
+    XUnmapWindow(d, w);
+    XSync(d, False);
+    start = Now();
+    XMapWindow(d, w);
+    XSync(d, False);
+    return WaitForDraw(d, w, size / 2, size / 2, start);
+}
+
+/* The first draw after a resize, at the old size: the one that
+ * fills the cleared window.  moonroot redraws at the new size once
+ * the resize settles.
+ */
+static double TimeResize(Display* d, Window w, int i)
+{
+    static int size = 0;
+    int newsize;
+    double start, t;
+
+    if (!size)
+        size = Size(d, w);
+    newsize = i % 2 ? size : size + 32;
+    start = Now();
+    XResizeWindow(d, w, newsize, newsize);
+    XSync(d, False);
+    t = WaitForDraw(d, w, size / 2, size / 2, start);
+    usleep(2 * RESIZE_SETTLE_US);
+    return t;
+}
+
+/* Drag the window 8 pixels right or back, as moonroot sees a drag. */
+static double TimeDrag(Display* d, Window w, int i)
+{
+    Window child;
+    XEvent ev;
+    int x, y, dx = i % 2 ? -8 : 8;
+    double start, t;
+
+    XTranslateCoordinates(d, w, DefaultRootWindow(d), 0, 0, &x, &y, &child);
+    memset(&ev, 0, sizeof ev);
+    ev.xbutton.type = ButtonPress;
+    ev.xbutton.window = w;
+    ev.xbutton.root = DefaultRootWindow(d);
+    ev.xbutton.x = ev.xbutton.y = 10;
+    ev.xbutton.x_root = x + 10;
+    ev.xbutton.y_root = y + 10;
+    ev.xbutton.button = Button1;
+    ev.xbutton.same_screen = True;
+
+    /* An empty mask sends it to the window's creator: moonroot */
+    start = Now();
+    XSendEvent(d, w, False, 0, &ev);
+
+    ev.xmotion.type = MotionNotify;
+    ev.xmotion.x = 10 + dx;
+    ev.xmotion.x_root = x + 10 + dx;
+    ev.xmotion.state = Button1Mask;
+    ev.xmotion.is_hint = NotifyNormal;
+    XSendEvent(d, w, False, 0, &ev);
+    XSync(d, False);
+    t = WaitForMove(d, w, x, y, start);
+
+    ev.xbutton.type = ButtonRelease;
+    ev.xbutton.button = Button1;
+    XSendEvent(d, w, False, 0, &ev);
+    XSync(d, False);
+    return t;
+}
+
+static int CompareTimes(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Run test count times and print its percentiles. */
+static void Measure(Display* d, Window w, const char* name,
+                    double (*test)(Display*, Window, int), int count)
+{
+    double* times = malloc(count * sizeof *times);
+    int i, n = 0, timeouts = 0;
+
+    if (!times)
+        return;
+    for (i = 0; i < count; ++i)
+    {
+        double t = test(d, w, i);
+
+        if (t < 0.)
+            ++timeouts;
+        else
+            times[n++] = t;
+    }
+    qsort(times, n, sizeof *times, CompareTimes);
+    if (n)
+        printf("%-8s %6d %10.3f %10.3f %10.3f %9d\n", name, n,
+               times[n / 2] / 1e3, times[(n * 99) / 100] / 1e3,
+               times[n - 1] / 1e3, timeouts);
+    else
+        printf("%-8s %6d %10s %10s %10s %9d\n", name, 0, "-", "-", "-",
+               timeouts);
+    free(times);
+}
+
+static void Usage()
+{
+    printf("Usage: moonbench [-display name] [-moonroot path] [-n count]\n");
+    printf("                 [-screen WxHxD] [-socket path]\n");
+    printf("                 [-- moonroot args...]\n\n");
+    printf("Times how long after an Expose, a map, a resize and a drag\n");
+    printf("moonroot's window shows the result, and prints the median,\n");
+    printf("99th percentile and worst, in milliseconds.\n\n");
+    printf("Without -display, starts an Xvfb (-screen, default\n");
+    printf("1920x1080x24) with a moonroot on it (-moonroot, default\n");
+    printf("./moonroot), which gets any args after --.  With -display,\n");
+    printf("uses the moonroot already on that server, unless -moonroot\n");
+    printf("is given too.  -n sets the runs of each (default 100).\n");
+    printf("\nA moonroot it starts gets a control socket; -socket names\n");
+    printf("that of one already running.  Through it, moonbench says\n");
+    printf("how many times the moon was resampled for the resizes.\n");
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* display = 0;
+    const char* moonroot = 0;
+    const char* screen = "1920x1080x24";
+    char** args = 0;
+    int nargs = 0, count = 100, status = 1, i;
+    char name[32];
+    char socketDir[] = "/tmp/moonbench-XXXXXX";
+    int resamples;
+    pid_t xvfb = -1;
+    Display* d;
+    Window w = None;
+    XColor color;
+    double start;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-display") && i + 1 < argc)
+            display = argv[++i];
+        else if (!strcmp(argv[i], "-moonroot") && i + 1 < argc)
+            moonroot = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+        {
+            count = atoi(argv[++i]);
+            if (count < 1)
+                Usage();
+        }
+        else if (!strcmp(argv[i], "-screen") && i + 1 < argc)
+            screen = argv[++i];
+        else if (!strcmp(argv[i], "-socket") && i + 1 < argc)
+            snprintf(controlPath, sizeof controlPath, "%s", argv[++i]);
+        else if (!strcmp(argv[i], "--"))
+        {
+            args = argv + i + 1;
+            nargs = argc - i - 1;
+            break;
+        }
+        else
+            Usage();
+    }
+    if (nargs > MAX_ARGS)
+        Usage();
+
+    if (!display)
+    {
+        xvfb = StartXvfb(screen, name, sizeof name);
+        if (xvfb < 0)
+        {
+            fprintf(stderr, "moonbench: can't start Xvfb\n");
+            return 1;
+        }
+        display = name;
+        if (!moonroot)
+            moonroot = "./moonroot";
+    }
+    /* A socket only we can reach, for a moonroot we start */
+    if (moonroot && !*controlPath && mkdtemp(socketDir))
+        snprintf(controlPath, sizeof controlPath, "%s/moonroot.sock",
+                 socketDir);
+    if (moonroot && StartMoonroot(moonroot, display, args, nargs) != 0)
+    {
+        fprintf(stderr, "moonbench: can't start %s\n", moonroot);
+        goto done;
+    }
+
+    if (!(d = XOpenDisplay(display)))
+    {
+        fprintf(stderr, "moonbench: can't open display %s\n", display);
+        goto done;
+    }
+    XSetErrorHandler(IgnoreErrors);
+
+    /* Wait for the window, and for it to be drawn */
+    start = Now();
+    while (Now() - start < 10e6
+           && (w = FindMoonWindow(d, DefaultRootWindow(d))) == None)
+        usleep(50000);
+    if (w == None)
+    {
+        fprintf(stderr, "moonbench: no moonroot window on %s\n", display);
+        goto done;
+    }
+    usleep(500000);
+
+    color.red = color.blue = 0xffff;
+    color.green = 0;
+    if (!XAllocColor(d, DefaultColormap(d, DefaultScreen(d)), &color))
+    {
+        fprintf(stderr, "moonbench: can't allocate the marker colour\n");
+        goto done;
+    }
+    marker = color.pixel;
+    XSetWindowBackground(d, w, marker);
+
+    printf("moonroot on %s, %d runs each\n", display, count);
+    printf("%-8s %6s %10s %10s %10s %9s\n",
+           "event", "n", "p50 ms", "p99 ms", "max ms", "timeouts");
+    Measure(d, w, "expose", TimeExpose, count);
+    Measure(d, w, "map", TimeMap, count);
+    resamples = Resamples();
+    Measure(d, w, "resize", TimeResize, count);
+    if (resamples >= 0 && (i = Resamples()) >= 0)
+        printf("%d resizes resampled the moon %d times\n",
+               count, i - resamples);
+    Measure(d, w, "drag", TimeDrag, count);
+
+    /* Leave a server we didn't start as we found it */
+    XSetWindowBackground(d, w, BlackPixel(d, DefaultScreen(d)));
+    XCloseDisplay(d);
+    status = 0;
+
+done:
+    /* moonroot goes when its server does */
+    if (xvfb > 0)
+    {
+        kill(xvfb, SIGTERM);
+        waitpid(xvfb, 0, 0);
+    }
+    if (xvfb > 0 && strcmp(socketDir, "/tmp/moonbench-XXXXXX"))
+    {
+        unlink(controlPath);
+        rmdir(socketDir);
+    }
+    return status;
+}
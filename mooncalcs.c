@@ -10,6 +10,7 @@
 #include <math.h>
 #include <time.h>
 #include <stdio.h>
+#include <pthread.h>
 
 double UnixTimeToJulian(time_t sec);
 int parseMonth(char* mon);
@@ -30,7 +31,7 @@ double angle(double deg)
  * Equation from Meeus eqn. 46.4.
  * Returns -1. for error.
  */
-double GetPhaseAngle(time_t date)
+static double PhaseAngle(time_t date)
 {
     /* Time measured in Julian centuries from epoch J2000.0: */
     /* was 946728057... why? 946684800 should be right. */
@@ -70,11 +71,101 @@ double GetPhaseAngle(time_t date)
                      - 0.110 * sin(D) ) );
 }
 
-void PaintDarkside(int moonsize, time_t date)
+/* Recent answers, shared by every display's thread: displays
+ * redrawing in the same second only work out the phase once.
+ */
+#define PHASE_MEMO_SIZE 16
+
+static struct {
+    int valid;
+    time_t date;
+    double phase;
+} phaseMemo[PHASE_MEMO_SIZE];
+static pthread_mutex_t phaseLock = PTHREAD_MUTEX_INITIALIZER;
+
+double GetPhaseAngle(time_t date)
+{
+    double start = StatsClock();
+    int slot = (unsigned long)date % PHASE_MEMO_SIZE;
+    double phase;
+    int found;
+
+    pthread_mutex_lock(&phaseLock);
+    found = phaseMemo[slot].valid && phaseMemo[slot].date == date;
+    phase = phaseMemo[slot].phase;
+    pthread_mutex_unlock(&phaseLock);
+
+    if (!found)
+    {
+        phase = PhaseAngle(date);
+        pthread_mutex_lock(&phaseLock);
+        phaseMemo[slot].valid = 1;
+        phaseMemo[slot].date = date;
+        phaseMemo[slot].phase = phase;
+        pthread_mutex_unlock(&phaseLock);
+    }
+
+    StatsRecord(STAT_PHASE_US, StatsClock() - start);
+    return phase;
+}
+
+/* Direction of the sun as seen from the moon, in the viewer's frame:
+ * x to the right, y down, z toward the viewer, unit length.
+ * At full moon that's straight at us (0, 0, 1).
+ * (This ignores the tilt of the terminator, like PaintDarkside.)
+ */
+void GetSunDirection(time_t date, double sun[3])
+{
+    double positionAngle = M_PI - GetPhaseAngle(date);
+
+    sun[0] = sin(positionAngle);
+    sun[1] = 0.;
+    sun[2] = -cos(positionAngle);
+}
+
+/* The fraction of the disc that's lit, 0 (new) to 1 (full). */
+double GetIlluminatedFraction(time_t date)
+{
+    return (1. + cos(GetPhaseAngle(date))) / 2.;
+}
+
+/* The first full moon after date, to the second.
+ * The phase angle falls steadily through each month, and jumps from
+ * 0 back up to 2 pi at full moon: step until it jumps, then bisect.
+ */
+time_t NextFullMoon(time_t date)
+{
+    time_t lo = date, hi = date;
+    double prev = GetPhaseAngle(date);
+
+    /* A day at a time: the phase angle moves about 12 degrees a day */
+    for (;;)
+    {
+        double phase;
+        hi = lo + 86400;
+        phase = GetPhaseAngle(hi);
+        if (phase > prev)
+            break;
+        prev = phase;
+        lo = hi;
+    }
+
+    while (hi - lo > 1)
+    {
+        time_t mid = lo + (hi - lo) / 2;
+        if (GetPhaseAngle(mid) > GetPhaseAngle(lo))
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return hi;
+}
+
+void PaintDarkside(MoonContext* ctx, Drawable d, int moonsize, time_t date)
 {
+    double start = StatsClock();
     double phaseAngle = GetPhaseAngle(date);
     int moonradius = moonsize / 2;
-    static GC darksideGC = 0;
     double positionAngle, cosTerm, rsquared;
     int whichQuarter;
     int j;
@@ -97,12 +188,13 @@ void PaintDarkside(int moonsize, time_t date)
     rsquared = moonradius*moonradius;
     whichQuarter = ((int)(positionAngle*2./M_PI) + 4) % 4;
 
-    if (darksideGC == 0) {
+    if (ctx->darksideGC == 0) {
         /* dim the moon, rather than blackening it. */
         XGCValues gcv;
-        gcv.foreground = WhitePixel(dpy, screen) / 3;
+        gcv.foreground = WhitePixel(ctx->dpy, ctx->screen) / 3;
         gcv.function = GXand;
-        darksideGC = XCreateGC(dpy, win, GCForeground | GCFunction, &gcv);
+        ctx->darksideGC = XCreateGC(ctx->dpy, ctx->win,
+                                    GCForeground | GCFunction, &gcv);
     }
 
     for (j=0; j <= moonradius; ++j)
@@ -113,8 +205,11 @@ void PaintDarkside(int moonsize, time_t date)
         int x1 = moonradius - (whichQuarter < 2 ? rr : xx);
         int w = rr + xx + 1;
 
-        XFillRectangle(dpy, win, darksideGC, x1, moonradius-j, w, 1);
-        XFillRectangle(dpy, win, darksideGC, x1, moonradius+j, w, 1);
+        XFillRectangle(ctx->dpy, d, ctx->darksideGC,
+                       x1, moonradius-j, w, 1);
+        XFillRectangle(ctx->dpy, d, ctx->darksideGC,
+                       x1, moonradius+j, w, 1);
     }
+    StatsRecord(STAT_DARKSIDE_US, StatsClock() - start);
 }
 
@@ -0,0 +1,101 @@
+/*
+ * moonclock.c: where "now" comes from.
+ *
+ * Drawing asks a MoonClock for the time instead of calling time(),
+ * so a moon can be shown at a fixed instant, shifted from now, or
+ * running faster (or slower, or backwards) than real time.  A fixed
+ * clock makes every frame the same, for comparing images; a fast one
+ * replays weeks in minutes.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parse a -clock spec into clk:
+ *     real             the system clock
+ *     fixed:T          always unix time T
+ *     offset:S         the system clock, S seconds ahead (or behind)
+ *     scaled:R[:T]     R seconds go by for each real one, from T
+ *                      (default now)
+ * Returns 0 on success, -1 if spec isn't one of those.
+ */
+int ParseClock(const char* spec, MoonClock* clk)
+{
+    char* end;
+
+    memset(clk, 0, sizeof *clk);
+    clk->rate = 1.;
+    if (!strcmp(spec, "real"))
+    {
+        clk->mode = CLOCK_REAL;
+        return 0;
+    }
+    if (!strncmp(spec, "fixed:", 6))
+    {
+        clk->mode = CLOCK_FIXED;
+        clk->base = strtol(spec + 6, &end, 10);
+        clk->rate = 0.;
+        return end > spec + 6 && !*end ? 0 : -1;
+    }
+    if (!strncmp(spec, "offset:", 7))
+    {
+        clk->mode = CLOCK_OFFSET;
+        clk->base = strtol(spec + 7, &end, 10);
+        return end > spec + 7 && !*end ? 0 : -1;
+    }
+    if (!strncmp(spec, "scaled:", 7))
+    {
+        clk->mode = CLOCK_SCALED;
+        clk->rate = strtod(spec + 7, &end);
+        if (end == spec + 7 || clk->rate == 0.)
+            return -1;
+        clk->base = time(0);
+        if (*end == ':')
+        {
+            const char* t = end + 1;
+            clk->base = strtol(t, &end, 10);
+            if (end == t)
+                return -1;
+        }
+        clk->start = StatsClock();
+        return *end ? -1 : 0;
+    }
+    return -1;
+}
+
+/* The time on clk; a null clock is the system clock. */
+time_t ClockNow(const MoonClock* clk)
+{
+    if (!clk)
+        return time(0);
+    switch (clk->mode)
+    {
+        case CLOCK_FIXED:
+            return clk->base;
+        case CLOCK_OFFSET:
+            return time(0) + clk->base;
+        case CLOCK_SCALED:
+            return clk->base
+                + (time_t)((StatsClock() - clk->start) / 1e6 * clk->rate);
+        default:
+            return time(0);
+    }
+}
+
+/* How many of clk's seconds go by in a real one: 0 if it's stopped. */
+double ClockRate(const MoonClock* clk)
+{
+    return clk ? clk->rate : 1.;
+}
+
+/* The time the context's moon should show. */
+time_t MoonTime(const MoonContext* ctx)
+{
+    return ClockNow(ctx->clock) + ctx->timeOffset;
+}
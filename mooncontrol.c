@@ -0,0 +1,251 @@
+/*
+ * mooncontrol.c: a Unix-domain socket for controlling a running moonroot.
+ *
+ * The protocol is lines of text: a client sends a command line and
+ * gets back one line of reply, starting with "ok" or "error".
+ * Everything runs from the event loop, with non-blocking sockets, so a
+ * slow or stuck client can't hold up drawing.  moonctl is a client.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#define _GNU_SOURCE     /* for accept4 */
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS 8
+#define LINE_MAX_LEN 256
+
+typedef struct {
+    int fd;
+    int len;
+    char line[LINE_MAX_LEN];
+} Client;
+
+static int listenFd = -1;
+static char socketPath[sizeof ((struct sockaddr_un*)0)->sun_path];
+static Client clients[MAX_CLIENTS];
+static ControlProc controlProc = 0;
+static void* controlData = 0;
+
+/* Without $XDG_RUNTIME_DIR, sockets go in a directory of the user's
+ * own under /tmp, which StartControl makes private.
+ */
+static void FallbackDir(char* dir, size_t len)
+{
+    snprintf(dir, len, "/tmp/moonroot-%u", (unsigned int)getuid());
+}
+
+/* Where the socket for a display lives, if not given with -control:
+ * in $XDG_RUNTIME_DIR, or FallbackDir, named after the display.
+ */
+void DefaultControlPath(const char* display, char* path, size_t len)
+{
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    char fallback[64];
+
+    if (!dir || !*dir)
+    {
+        FallbackDir(fallback, sizeof fallback);
+        dir = fallback;
+    }
+    if (!display || !*display)
+        display = getenv("DISPLAY");
+    if (!display)
+        display = "";
+    snprintf(path, len, "%s/moonroot%s.sock", dir, display);
+}
+
+/* If path is in FallbackDir, make sure the directory is there, ours
+ * and closed to everyone else: anyone who can reach the socket can
+ * quit moonroot or change what it shows.  Returns 0 if it's safe.
+ */
+static int CheckFallbackDir(const char* path)
+{
+    char dir[64];
+    size_t n;
+    struct stat st;
+
+    FallbackDir(dir, sizeof dir);
+    n = strlen(dir);
+    if (strncmp(path, dir, n) != 0 || path[n] != '/')
+        return 0;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+        return -1;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != getuid() || (st.st_mode & 077))
+    {
+        fprintf(stderr, "moonroot: %s isn't a private directory of "
+                "yours: not using it\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+static void CloseClient(Client* c)
+{
+    UnwatchFd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void Reply(Client* c, const char* reply)
+{
+    char buf[LINE_MAX_LEN + 1];
+    int len = snprintf(buf, sizeof buf, "%s\n", reply);
+
+    /* Replies are short: a client that can't take one isn't reading */
+    if (send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+        CloseClient(c);
+}
+
+static void ReadClient(int fd, void* data)
+{
+    Client* c = data;
+    ssize_t n;
+
+    n = read(fd, c->line + c->len, sizeof c->line - 1 - c->len);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            CloseClient(c);
+        return;
+    }
+    c->len += n;
+
+    /* Answer each complete line */
+    while (c->fd >= 0)
+    {
+        char reply[LINE_MAX_LEN];
+        char* eol = memchr(c->line, '\n', c->len);
+        int used;
+
+        if (!eol)
+        {
+            if (c->len >= (int)sizeof c->line - 1)
+            {
+                Reply(c, "error line too long");
+                if (c->fd >= 0)
+                    CloseClient(c);
+            }
+            return;
+        }
+        *eol = '\0';
+        if (eol > c->line && eol[-1] == '\r')
+            eol[-1] = '\0';
+        used = eol + 1 - c->line;
+
+        controlProc(c->line, reply, sizeof reply, controlData);
+        Reply(c, reply);
+
+        memmove(c->line, c->line + used, c->len - used);
+        c->len -= used;
+    }
+}
+
+static void AcceptClient(int fd, void* data)
+{
+    int cfd, i;
+
+    while ((cfd = accept4(fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        for (i = 0; i < MAX_CLIENTS; ++i)
+            if (clients[i].fd < 0)
+                break;
+        if (i == MAX_CLIENTS || WatchFd(cfd, ReadClient, &clients[i]) != 0)
+        {
+            static const char busy[] = "error too many clients\n";
+            send(cfd, busy, sizeof busy - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(cfd);
+            continue;
+        }
+        clients[i].fd = cfd;
+        clients[i].len = 0;
+    }
+}
+
+/* Listen on path, passing each command line to proc with data.
+ * Returns 0 on success.
+ */
+int StartControl(const char* path, ControlProc proc, void* data)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int i, bound;
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        return -1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (CheckFallbackDir(path) != 0)
+        return -1;
+
+    /* Remove a socket left behind by a moonroot of ours that didn't
+     * exit cleanly, but not one that's still being served, nor
+     * anything else that happens to have the name.
+     */
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+        return -1;
+    if (connect(listenFd, (struct sockaddr*)&addr, sizeof addr) != 0
+        && errno == ECONNREFUSED
+        && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)
+        && st.st_uid == getuid())
+        unlink(path);
+    close(listenFd);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      0);
+    if (listenFd < 0)
+        return -1;
+
+    /* Only the user may connect.  This runs before any threads, so
+     * the umask can be changed around the bind.
+     */
+    mask = umask(077);
+    bound = bind(listenFd, (struct sockaddr*)&addr, sizeof addr);
+    umask(mask);
+    if (bound != 0
+        || listen(listenFd, MAX_CLIENTS) != 0
+        || WatchFd(listenFd, AcceptClient, 0) != 0)
+    {
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+
+    strcpy(socketPath, path);
+    controlProc = proc;
+    controlData = data;
+    for (i = 0; i < MAX_CLIENTS; ++i)
+        clients[i].fd = -1;
+    return 0;
+}
+
+void StopControl()
+{
+    int i;
+
+    if (listenFd < 0)
+        return;
+    for (i = 0; i < MAX_CLIENTS; ++i)
+        if (clients[i].fd >= 0)
+            CloseClient(&clients[i]);
+    UnwatchFd(listenFd);
+    close(listenFd);
+    unlink(socketPath);
+    listenFd = -1;
+}
@@ -0,0 +1,172 @@
+/*
+ * moonctl: send commands to a running moonroot started with -control.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void Usage()
+{
+    printf("Usage: moonctl [-socket path] [-display name] command [arg]\n");
+    printf("       moonctl [-socket path] [-display name] -bench count\n");
+    printf("\nCommands: phase, nextfull, redraw, size diameter,\n");
+    printf("    time [unixtime], resamples, ping, quit.\n");
+    printf("resamples says how many times the moon has been scaled\n");
+    printf("    from a bigger one since moonroot started.\n");
+    printf("-bench sends that many pings and reports round-trip times.\n");
+    exit(1);
+}
+
+static int Connect(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send one command and read its one-line reply.  Returns 0 on success. */
+static int Command(int fd, const char* cmd, char* reply, size_t len)
+{
+    char line[256];
+    int linelen = snprintf(line, sizeof line, "%s\n", cmd);
+    size_t got = 0;
+
+    if (linelen >= (int)sizeof line || write(fd, line, linelen) != linelen)
+        return -1;
+    /* The server answers one line at a time, so nothing follows it */
+    while (got < len - 1)
+    {
+        ssize_t n = read(fd, reply + got, len - 1 - got);
+        char* eol;
+        if (n <= 0)
+            return -1;
+        eol = memchr(reply + got, '\n', n);
+        got += n;
+        if (eol)
+        {
+            *eol = '\0';
+            return 0;
+        }
+    }
+    reply[got] = '\0';
+    return 0;
+}
+
+static double Microseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+/* Time count ping round trips and print the distribution. */
+static int Bench(int fd, int count)
+{
+    double* times = malloc(count * sizeof *times);
+    double total = 0.;
+    char reply[256];
+    int i;
+
+    if (!times)
+        return 1;
+    for (i = 0; i < count; ++i)
+    {
+        double start = Microseconds();
+        if (Command(fd, "ping", reply, sizeof reply) != 0)
+        {
+            fprintf(stderr, "moonctl: lost the connection\n");
+            return 1;
+        }
+        times[i] = Microseconds() - start;
+        total += times[i];
+    }
+    qsort(times, count, sizeof *times, CompareDoubles);
+    printf("%d round trips, microseconds: min %.1f  median %.1f  "
+           "mean %.1f  99%% %.1f  max %.1f\n",
+           count, times[0], times[count / 2], total / count,
+           times[(int)(count * .99)], times[count - 1]);
+    free(times);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char path[108];
+    const char* socketPath = 0;
+    const char* display = 0;
+    char cmd[256];
+    char reply[256];
+    int fd;
+
+    while (argc > 2 && argv[1][0] == '-' && strcmp(argv[1], "-bench"))
+    {
+        if (!strcmp(argv[1], "-socket"))
+            socketPath = argv[2];
+        else if (!strcmp(argv[1], "-display"))
+            display = argv[2];
+        else
+            Usage();
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2)
+        Usage();
+
+    if (socketPath)
+        snprintf(path, sizeof path, "%s", socketPath);
+    else
+        DefaultControlPath(display, path, sizeof path);
+    fd = Connect(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "moonctl: can't connect to %s\n", path);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "-bench"))
+    {
+        if (argc != 3 || atoi(argv[2]) < 1)
+            Usage();
+        return Bench(fd, atoi(argv[2]));
+    }
+
+    snprintf(cmd, sizeof cmd, "%s%s%s", argv[1],
+             argc > 2 ? " " : "", argc > 2 ? argv[2] : "");
+    if (Command(fd, cmd, reply, sizeof reply) != 0)
+    {
+        fprintf(stderr, "moonctl: no reply\n");
+        return 1;
+    }
+    printf("%s\n", reply);
+    return strncmp(reply, "ok", 2) != 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * moondesk.c: -root, the moon on the desktop background itself.
+ *
+ * Wallpaper setters (Esetroot, feh, hsetroot and the like) leave the
+ * background in a pixmap named by the root window's _XROOTPMAP_ID,
+ * which the server repaints the root from and pseudo-transparent
+ * programs copy.  If there's one, the moon is drawn into it, clipped
+ * to the moon's shape, and only the moon's square of the root is
+ * cleared to show it.  What the moon covered is kept, to put back
+ * when it changes size or goes away.  Without one, the moon is drawn
+ * straight onto the root window, and again whenever something
+ * uncovers it.
+ *
+ * Either way an update touches the moon's square and nothing else:
+ * the rest of the background is never repainted.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <X11/Xatom.h>
+
+struct DeskState {
+    Window root;
+    int x, y;                   /* the moon's top left on the root */
+    Atom pmapAtom;              /* _XROOTPMAP_ID */
+    Pixmap wallpaper;           /* or None: draw on the window */
+    unsigned int wallWidth, wallHeight;
+    int gone;                   /* freed by whoever set the next one */
+    GC gc;                      /* no exposures; clip origin at x, y */
+    Pixmap clip;                /* gc's clip mask */
+    Pixmap under;               /* the wallpaper the moon covers */
+    unsigned int shownDiam;     /* of the moon on the root, or 0 */
+
+    Display* dpy;
+    struct DeskState* next;
+};
+
+/* Whoever sets the next wallpaper may free this one at any time, and
+ * drawing into it then is an error that would end the program.  The
+ * error handler is process-wide, so it keeps a list of the wallpapers
+ * in use, and errors on those only mark them gone: a new
+ * _XROOTPMAP_ID follows.
+ */
+static pthread_mutex_t desksLock = PTHREAD_MUTEX_INITIALIZER;
+static struct DeskState* desks;
+static int handlerInstalled;
+static int (*oldHandler)(Display*, XErrorEvent*);
+
+static int DeskErrorHandler(Display* d, XErrorEvent* err)
+{
+    struct DeskState* ds;
+    int ours = 0;
+
+    if (err->error_code == BadDrawable || err->error_code == BadPixmap)
+    {
+        pthread_mutex_lock(&desksLock);
+        for (ds = desks; ds; ds = ds->next)
+            if (ds->dpy == d && ds->wallpaper != None
+                && ds->wallpaper == err->resourceid)
+            {
+                ds->gone = 1;
+                ours = 1;
+            }
+        pthread_mutex_unlock(&desksLock);
+    }
+    if (ours)
+        return 0;
+    return oldHandler ? oldHandler(d, err) : 0;
+}
+
+/* Find the current wallpaper, if it's one the moon can be drawn in:
+ * the screen's depth, and at the root's origin.
+ */
+static void FindWallpaper(MoonContext* ctx, struct DeskState* ds)
+{
+    Display* dpy = ctx->dpy;
+    Atom type;
+    int format, x, y;
+    unsigned long n, after;
+    unsigned char* data = 0;
+    Window root;
+    unsigned int border, depth;
+    Pixmap pix = None;
+
+    TraceRoundTrip(dpy, "XGetWindowProperty");
+    if (XGetWindowProperty(dpy, ds->root, ds->pmapAtom, 0, 1, False,
+                           XA_PIXMAP, &type, &format, &n, &after,
+                           &data) == Success
+        && type == XA_PIXMAP && format == 32 && n == 1)
+        pix = *(Pixmap*)data;
+    if (data)
+        XFree(data);
+
+    /* Listed first, so a stale id only fails the query */
+    pthread_mutex_lock(&desksLock);
+    ds->wallpaper = pix;
+    ds->gone = 0;
+    pthread_mutex_unlock(&desksLock);
+    if (pix == None)
+        return;
+
+    TraceRoundTrip(dpy, "XGetGeometry");
+    if (!XGetGeometry(dpy, pix, &root, &x, &y, &ds->wallWidth,
+                      &ds->wallHeight, &border, &depth)
+        || ds->gone || depth != (unsigned int)ctx->depth)
+        ds->wallpaper = None;
+}
+
+/* Can this moon go in the wallpaper?  It has to fit. */
+static int UseWallpaper(MoonContext* ctx, struct DeskState* ds)
+{
+    return ds->wallpaper != None && !ds->gone
+        && ds->x >= 0 && ds->y >= 0
+        && ds->x + ctx->diam <= ds->wallWidth
+        && ds->y + ctx->diam <= ds->wallHeight;
+}
+
+static void SetClip(Display* dpy, struct DeskState* ds, Pixmap mask)
+{
+    if (ds->clip != mask)
+        XSetClipMask(dpy, ds->gc, mask);
+    ds->clip = mask;
+}
+
+/* Take the moon off the background, leaving what was there; show
+ * that now if show, else the caller will.
+ */
+static void Uncover(MoonContext* ctx, struct DeskState* ds, int show)
+{
+    Display* dpy = ctx->dpy;
+
+    if (ds->under != None)
+    {
+        if (ds->wallpaper != None && !ds->gone)
+        {
+            SetClip(dpy, ds, None);
+            XCopyArea(dpy, ds->under, ds->wallpaper, ds->gc,
+                      0, 0, ds->shownDiam, ds->shownDiam, ds->x, ds->y);
+        }
+        XFreePixmap(dpy, ds->under);
+        ds->under = None;
+    }
+    if (ds->shownDiam && show)
+        XClearArea(dpy, ds->root, ds->x, ds->y,
+                   ds->shownDiam, ds->shownDiam, False);
+    ds->shownDiam = 0;
+}
+
+/* Draw the moon on the root window, with its top left at x, y.
+ * Returns 0 on success.
+ */
+int InitDesk(MoonContext* ctx, int x, int y)
+{
+    Display* dpy = ctx->dpy;
+    struct DeskState* ds = calloc(1, sizeof *ds);
+    XGCValues gcValues;
+
+    if (!ds)
+        return -1;
+    ds->dpy = dpy;
+    ds->root = RootWindow(dpy, ctx->screen);
+    ds->x = x;
+    ds->y = y;
+
+    gcValues.graphics_exposures = False;
+    gcValues.clip_x_origin = x;
+    gcValues.clip_y_origin = y;
+    ds->gc = XCreateGC(dpy, ds->root,
+                       GCGraphicsExposures | GCClipXOrigin | GCClipYOrigin,
+                       &gcValues);
+    TraceRoundTrip(dpy, "XInternAtom");
+    ds->pmapAtom = XInternAtom(dpy, "_XROOTPMAP_ID", False);
+
+    pthread_mutex_lock(&desksLock);
+    ds->next = desks;
+    desks = ds;
+    if (!handlerInstalled)
+    {
+        oldHandler = XSetErrorHandler(DeskErrorHandler);
+        handlerInstalled = 1;
+    }
+    pthread_mutex_unlock(&desksLock);
+    ctx->desk = ds;
+
+    FindWallpaper(ctx, ds);
+
+    /* Other clients may select these on the root too */
+    XSelectInput(dpy, ds->root, ExposureMask | PropertyChangeMask);
+    return 0;
+}
+
+/* Is the moon in the wallpaper, rather than on the root window? */
+int DrawsOnWallpaper(MoonContext* ctx)
+{
+    return ctx->desk && UseWallpaper(ctx, ctx->desk);
+}
+
+/* Show the moon drawn in back, shaped by mask. */
+void PresentOnDesk(MoonContext* ctx, Drawable back, Pixmap mask)
+{
+    Display* dpy = ctx->dpy;
+    struct DeskState* ds = ctx->desk;
+    unsigned int shown = ds->shownDiam;
+    unsigned int clear = ctx->diam > shown ? ctx->diam : shown;
+
+    /* A new size needs a new square of wallpaper kept.  In the
+     * wallpaper, the old moon and the new are shown in one step.
+     */
+    if (shown && shown != ctx->diam)
+        Uncover(ctx, ds, !UseWallpaper(ctx, ds));
+
+    if (!UseWallpaper(ctx, ds))
+    {
+        SetClip(dpy, ds, mask);
+        XCopyArea(dpy, back, ds->root, ds->gc, 0, 0,
+                  ctx->diam, ctx->diam, ds->x, ds->y);
+        ds->shownDiam = ctx->diam;
+        return;
+    }
+
+    if (ds->under == None)
+    {
+        ds->under = XCreatePixmap(dpy, ds->root, ctx->diam, ctx->diam,
+                                  ctx->depth);
+        SetClip(dpy, ds, None);
+        XCopyArea(dpy, ds->wallpaper, ds->under, ds->gc,
+                  ds->x, ds->y, ctx->diam, ctx->diam, 0, 0);
+    }
+    SetClip(dpy, ds, mask);
+    XCopyArea(dpy, back, ds->wallpaper, ds->gc, 0, 0,
+              ctx->diam, ctx->diam, ds->x, ds->y);
+    /* The server repaints just this much of the root from it */
+    XClearArea(dpy, ds->root, ds->x, ds->y, clear, clear, False);
+    ds->shownDiam = ctx->diam;
+}
+
+/* An event on the root window: does the moon need drawing again? */
+int HandleDeskEvent(MoonContext* ctx, XEvent* event)
+{
+    struct DeskState* ds = ctx->desk;
+    int size = ctx->diam;
+
+    switch (event->type)
+    {
+        /* The server repaints a wallpaper moon by itself */
+        case Expose:
+            return !UseWallpaper(ctx, ds)
+                && event->xexpose.x < ds->x + size
+                && event->xexpose.y < ds->y + size
+                && event->xexpose.x + event->xexpose.width > ds->x
+                && event->xexpose.y + event->xexpose.height > ds->y;
+
+        /* A new wallpaper: what the moon covered is gone with the old */
+        case PropertyNotify:
+            if (event->xproperty.atom != ds->pmapAtom)
+                return 0;
+            if (ds->under != None)
+                XFreePixmap(ctx->dpy, ds->under);
+            ds->under = None;
+            ds->shownDiam = 0;
+            FindWallpaper(ctx, ds);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/* Take the moon off the background and forget it. */
+void FreeDeskState(MoonContext* ctx)
+{
+    struct DeskState* ds = ctx->desk;
+    struct DeskState** pp;
+
+    if (!ds)
+        return;
+    Uncover(ctx, ds, 1);
+    XFreeGC(ctx->dpy, ds->gc);
+    XFlush(ctx->dpy);
+
+    pthread_mutex_lock(&desksLock);
+    for (pp = &desks; *pp; pp = &(*pp)->next)
+        if (*pp == ds)
+        {
+            *pp = ds->next;
+            break;
+        }
+    pthread_mutex_unlock(&desksLock);
+    free(ds);
+    ctx->desk = 0;
+}
@@ -0,0 +1,744 @@
+/*
+ * moonfile.c: draw the moon into memory and write it out as a PPM or
+ * PNG file, for machines without an X server.
+ *
+ * The image depends only on the time, the size and the shading
+ * settings, never on a display, so the same arguments always give
+ * the same bytes and files can be cached.
+ *
+ * ExportFrames draws a run of them, a time-lapse, on a pool of
+ * threads: each has its own context and buffers, and hands encoded
+ * frames to a writer that puts them out in order.
+ *
+ * CompareMoonImage reads one back, to check a new build still draws
+ * what an old one did.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+#include "moonpixel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/* Shade the context's moon for date into out, diam x diam
+ * premultiplied 0xAARRGGBB words.  Core and XRender shading need a
+ * server, so they shade on the CPU like RENDER_SHADE.
+ * Returns 0 on success.
+ */
+int RenderMoonImage(MoonContext* ctx, time_t date, unsigned int* out)
+{
+    static const PixelFormat argb = { 16, 8, 0, 0, 0, 0, 24 };
+    const unsigned int* moon = GetMoonARGB(ctx, ctx->diam);
+    double sun[3];
+
+    if (!moon)
+        return -1;
+    if (!ctx->shade && !(ctx->shade = NewShadeCache()))
+        return -1;
+    GetSunDirection(date, sun);
+    if (ctx->renderMode == RENDER_AA)
+        ShadeMoonAA(ctx->shade, moon, ctx->diam, sun, ctx->earthshine,
+                    &argb, out);
+    else
+        ShadeMoon(ctx->shade, moon, ctx->diam, sun, ctx->earthshine,
+                  &argb, out);
+    return 0;
+}
+
+/* Binary PPM: no alpha, so the moon is on black, which is just the
+ * premultiplied colour.
+ */
+static int WritePPM(FILE* fp, const unsigned int* argb, unsigned int diam)
+{
+    unsigned char* row = malloc(diam * 3);
+    unsigned int x, y;
+    int ok;
+
+    if (!row)
+        return -1;
+    ok = fprintf(fp, "P6\n%u %u\n255\n", diam, diam) > 0;
+    for (y = 0; ok && y < diam; ++y)
+    {
+        for (x = 0; x < diam; ++x)
+        {
+            unsigned int p = argb[y*diam + x];
+            row[3*x] = p >> 16;
+            row[3*x + 1] = p >> 8;
+            row[3*x + 2] = p;
+        }
+        ok = fwrite(row, 3, diam, fp) == diam;
+    }
+    free(row);
+    return ok ? 0 : -1;
+}
+
+static void PutBE32(unsigned char* p, unsigned long v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* One PNG chunk: length, type, data, CRC of type and data. */
+static int WriteChunk(FILE* fp, const char* type,
+                      const unsigned char* data, unsigned long len)
+{
+    unsigned char word[4];
+    unsigned long crc = crc32(0L, (const Bytef*)type, 4);
+
+    if (len)
+        crc = crc32(crc, data, len);
+    PutBE32(word, len);
+    if (fwrite(word, 4, 1, fp) != 1 || fwrite(type, 4, 1, fp) != 1
+        || (len && fwrite(data, len, 1, fp) != 1))
+        return -1;
+    PutBE32(word, crc);
+    return fwrite(word, 4, 1, fp) == 1 ? 0 : -1;
+}
+
+static unsigned long GetBE32(const unsigned char* p)
+{
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* A premultiplied pixel as PNG's straight-alpha RGBA bytes */
+static void StraightRGBA(unsigned int p, unsigned char* r)
+{
+    unsigned int a = p >> 24;
+
+    r[3] = a;
+    if (a == 0xff || a == 0)
+    {
+        r[0] = p >> 16;
+        r[1] = p >> 8;
+        r[2] = p;
+    }
+    else
+    {
+        unsigned int c;
+        c = ((p >> 16) & 0xff) * 255 / a;
+        r[0] = c > 255 ? 255 : c;
+        c = ((p >> 8) & 0xff) * 255 / a;
+        r[1] = c > 255 ? 255 : c;
+        c = (p & 0xff) * 255 / a;
+        r[2] = c > 255 ? 255 : c;
+    }
+}
+
+/* Buffers for encoding PNGs, kept from one image to the next */
+typedef struct {
+    unsigned char* raw;
+    unsigned char* z;
+    unsigned long rawSize, zSize;
+} PngBuffers;
+
+static void FreePngBuffers(PngBuffers* pb)
+{
+    free(pb->raw);
+    free(pb->z);
+    memset(pb, 0, sizeof *pb);
+}
+
+/* 8-bit RGBA PNG.  PNG wants straight alpha, so the anti-aliased
+ * edge pixels are unpremultiplied.
+ */
+static int WritePNG(FILE* fp, const unsigned int* argb, unsigned int diam,
+                    PngBuffers* pb)
+{
+    static const unsigned char signature[8] =
+        { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned long rawlen = (unsigned long)diam * (1 + 4 * diam);
+    uLongf zlen = compressBound(rawlen);
+    unsigned char* raw;
+    unsigned char ihdr[13];
+    unsigned int x, y;
+
+    if (pb->rawSize < rawlen || pb->zSize < zlen)
+    {
+        FreePngBuffers(pb);
+        pb->raw = malloc(rawlen);
+        pb->z = malloc(zlen);
+        if (!pb->raw || !pb->z)
+        {
+            FreePngBuffers(pb);
+            return -1;
+        }
+        pb->rawSize = rawlen;
+        pb->zSize = zlen;
+    }
+    raw = pb->raw;
+
+    for (y = 0; y < diam; ++y)
+    {
+        unsigned char* r = raw + y * (1 + 4 * diam);
+
+        *r++ = 0;               /* filter: none, for now */
+        for (x = 0; x < diam; ++x, r += 4)
+            StraightRGBA(argb[y*diam + x], r);
+    }
+
+    /* The Up filter, each row less the one above, from the bottom so
+     * the row above is still unfiltered.  With the fastest deflate
+     * level, that's about as small as the default level unfiltered,
+     * and four times as fast.
+     */
+    for (y = diam - 1; y > 0; --y)
+    {
+        unsigned char* r = raw + y * (1 + 4 * diam);
+        unsigned char* above = r - (1 + 4 * diam);
+
+        r[0] = 2;
+        for (x = 1; x <= 4 * diam; ++x)
+            r[x] -= above[x];
+    }
+    if (compress2(pb->z, &zlen, raw, rawlen, Z_BEST_SPEED) != Z_OK)
+        return -1;
+
+    PutBE32(ihdr, diam);
+    PutBE32(ihdr + 4, diam);
+    ihdr[8] = 8;                /* bits per channel */
+    ihdr[9] = 6;                /* RGBA */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    if (fwrite(signature, sizeof signature, 1, fp) == 1
+        && WriteChunk(fp, "IHDR", ihdr, sizeof ihdr) == 0
+        && WriteChunk(fp, "IDAT", pb->z, zlen) == 0
+        && WriteChunk(fp, "IEND", 0, 0) == 0)
+        return 0;
+    return -1;
+}
+
+/* PPM if the name ends in .ppm, else PNG */
+static int IsPPMName(const char* path)
+{
+    size_t len = strlen(path);
+
+    return len >= 4 && !strcmp(path + len - 4, ".ppm");
+}
+
+/* Write a diam x diam premultiplied ARGB image to path, "-" meaning
+ * stdout: PPM if the name ends in .ppm, else PNG.
+ * Returns 0 on success.
+ */
+int WriteMoonImage(const char* path, const unsigned int* argb,
+                   unsigned int diam)
+{
+    PngBuffers pb = { 0 };
+    int toStdout = !strcmp(path, "-");
+    FILE* fp = toStdout ? stdout : fopen(path, "wb");
+    int rv;
+
+    if (!fp)
+        return -1;
+    rv = IsPPMName(path) ? WritePPM(fp, argb, diam)
+                         : WritePNG(fp, argb, diam, &pb);
+    FreePngBuffers(&pb);
+    if (toStdout)
+    {
+        if (fflush(fp) != 0)
+            rv = -1;
+    }
+    else if (fclose(fp) != 0)
+        rv = -1;
+    return rv;
+}
+
+/* Read a PPM from WritePPM into diam x diam RGBA, alpha all 255.
+ * Returns the pixels, or 0.
+ */
+static unsigned char* ReadPPM(FILE* fp, unsigned int diam)
+{
+    unsigned int width, height, maxval, i;
+    unsigned char* rgba;
+
+    if (fscanf(fp, "P6 %u %u %u", &width, &height, &maxval) != 3
+        || width != diam || height != diam || maxval != 255
+        || getc(fp) == EOF)
+        return 0;
+    rgba = malloc((size_t)diam * diam * 4);
+    if (!rgba)
+        return 0;
+
+    /* Read RGB into the top of the buffer, then spread it out */
+    i = diam * diam;
+    if (fread(rgba + i, 3, i, fp) != i)
+    {
+        free(rgba);
+        return 0;
+    }
+    for (i = 0; i < diam * diam; ++i)
+    {
+        const unsigned char* p = rgba + diam * diam + 3 * i;
+        unsigned char r = p[0], g = p[1], b = p[2];
+
+        rgba[4*i] = r;
+        rgba[4*i + 1] = g;
+        rgba[4*i + 2] = b;
+        rgba[4*i + 3] = 255;
+    }
+    return rgba;
+}
+
+static unsigned char Paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/* Read a diam x diam 8-bit RGBA PNG, as WritePNG writes, with any
+ * filters.  The signature has been read.  Returns the pixels, or 0.
+ */
+static unsigned char* ReadPNG(FILE* fp, unsigned int diam)
+{
+    unsigned long stride = 1 + 4UL * diam, rawlen = stride * diam;
+    unsigned char* z = 0;
+    unsigned char* raw = 0;
+    unsigned char* rgba = 0;
+    unsigned long zlen = 0;
+    int gotHeader = 0;
+    unsigned int x, y;
+
+    for (;;)
+    {
+        unsigned char head[8], word[4];
+        unsigned long len;
+        unsigned char* data;
+
+        if (fread(head, 8, 1, fp) != 1)
+            goto fail;
+        len = GetBE32(head);
+        if (len > 0x7fffffff || !(data = malloc(len ? len : 1)))
+            goto fail;
+        if ((len && fread(data, len, 1, fp) != 1)
+            || fread(word, 4, 1, fp) != 1
+            || GetBE32(word) != crc32(crc32(0L, head + 4, 4), data, len))
+        {
+            free(data);
+            goto fail;
+        }
+
+        if (!memcmp(head + 4, "IHDR", 4))
+        {
+            gotHeader = len == 13 && GetBE32(data) == diam
+                && GetBE32(data + 4) == diam
+                && data[8] == 8 && data[9] == 6 && data[12] == 0;
+            free(data);
+            if (!gotHeader)
+                goto fail;
+        }
+        else if (!memcmp(head + 4, "IDAT", 4))
+        {
+            unsigned char* more = realloc(z, zlen + len);
+
+            if (!more)
+            {
+                free(data);
+                goto fail;
+            }
+            z = more;
+            memcpy(z + zlen, data, len);
+            zlen += len;
+            free(data);
+        }
+        else
+        {
+            free(data);
+            if (!memcmp(head + 4, "IEND", 4))
+                break;
+        }
+    }
+
+    raw = malloc(rawlen);
+    rgba = malloc((size_t)diam * diam * 4);
+    if (!gotHeader || !raw || !rgba)
+        goto fail;
+    {
+        uLongf outlen = rawlen;
+        if (uncompress(raw, &outlen, z, zlen) != Z_OK || outlen != rawlen)
+            goto fail;
+    }
+
+    for (y = 0; y < diam; ++y)
+    {
+        const unsigned char* r = raw + y * stride;
+        unsigned char* out = rgba + y * 4UL * diam;
+        const unsigned char* above = y ? out - 4UL * diam : 0;
+
+        for (x = 0; x < 4 * diam; ++x)
+        {
+            unsigned char a = x >= 4 ? out[x - 4] : 0;
+            unsigned char b = above ? above[x] : 0;
+            unsigned char c = above && x >= 4 ? above[x - 4] : 0;
+
+            switch (r[0])
+            {
+                case 0: out[x] = r[1 + x]; break;
+                case 1: out[x] = r[1 + x] + a; break;
+                case 2: out[x] = r[1 + x] + b; break;
+                case 3: out[x] = r[1 + x] + (a + b) / 2; break;
+                case 4: out[x] = r[1 + x] + Paeth(a, b, c); break;
+                default: goto fail;
+            }
+        }
+    }
+    free(z);
+    free(raw);
+    return rgba;
+
+fail:
+    free(z);
+    free(raw);
+    free(rgba);
+    return 0;
+}
+
+/* Read a stored moon as straight RGBA bytes, alpha 255 for a PPM. */
+static unsigned char* ReadMoonImage(const char* path, unsigned int diam,
+                                    int* png)
+{
+    static const unsigned char signature[8] =
+        { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned char head[8];
+    unsigned char* golden;
+    FILE* fp = fopen(path, "rb");
+
+    if (!fp)
+        return 0;
+    *png = fread(head, 8, 1, fp) == 1 && !memcmp(head, signature, 8);
+    if (!*png)
+        rewind(fp);
+    golden = *png ? ReadPNG(fp, diam) : ReadPPM(fp, diam);
+    fclose(fp);
+    return golden;
+}
+
+/* Compare a moon drawn by RenderMoonImage with one stored in path
+ * by WriteMoonImage, channel by channel in the file's own terms (a
+ * PPM has no alpha; a PNG has straight alpha).  Pixels off by more
+ * than tolerance are counted in diff.
+ * Returns 0, or -1 if path can't be read as a moon of that size.
+ */
+int CompareMoonImage(const char* path, const unsigned int* argb,
+                     unsigned int diam, int tolerance, ImageDiff* diff)
+{
+    unsigned char* golden;
+    unsigned long i;
+    int png;
+
+    if (!(golden = ReadMoonImage(path, diam, &png)))
+        return -1;
+
+    memset(diff, 0, sizeof *diff);
+    diff->pixels = (unsigned long)diam * diam;
+    for (i = 0; i < diff->pixels; ++i)
+    {
+        unsigned char ours[4];
+        int c, worst = 0;
+
+        if (png)
+            StraightRGBA(argb[i], ours);
+        else
+        {
+            ours[0] = argb[i] >> 16;
+            ours[1] = argb[i] >> 8;
+            ours[2] = argb[i];
+            ours[3] = 255;
+        }
+        for (c = 0; c < 4; ++c)
+        {
+            int d = abs(ours[c] - golden[4*i + c]);
+            if (d > worst)
+                worst = d;
+        }
+        if (worst > diff->maxDiff)
+            diff->maxDiff = worst;
+        if (worst > tolerance)
+            ++diff->differing;
+    }
+    free(golden);
+    return 0;
+}
+
+/* Compare a moon as a shaped window shows it with one stored in path.
+ * argb is what the window read back: opaque inside its shape, 0
+ * outside.  A window has no alpha, just the colour over black, so
+ * inside the shape the stored colour is premultiplied before
+ * comparing; outside it, the stored pixel must be less than half
+ * covered, as the shape masks take it.  A stored moon drawn by
+ * RenderMoonImage compares equal with the same moon drawn in a
+ * window with -render shade or aa.
+ * Returns 0, or -1 if path can't be read as a moon of that size.
+ */
+int CompareShownImage(const char* path, const unsigned int* argb,
+                      unsigned int diam, int tolerance, ImageDiff* diff)
+{
+    unsigned char* golden;
+    unsigned long i;
+    int png;
+
+    if (!(golden = ReadMoonImage(path, diam, &png)))
+        return -1;
+
+    memset(diff, 0, sizeof *diff);
+    diff->pixels = (unsigned long)diam * diam;
+    for (i = 0; i < diff->pixels; ++i)
+    {
+        const unsigned char* g = golden + 4*i;
+        int c, worst = 0;
+
+        if (argb[i] >> 24)
+            for (c = 0; c < 3; ++c)
+            {
+                int ours = (argb[i] >> (16 - 8*c)) & 0xff;
+                int d = abs(ours - (g[c] * g[3] + 127) / 255);
+                if (d > worst)
+                    worst = d;
+            }
+        else if (g[3] >= 0x80)
+            worst = g[3];
+        if (worst > diff->maxDiff)
+            diff->maxDiff = worst;
+        if (worst > tolerance)
+            ++diff->differing;
+    }
+    free(golden);
+    return 0;
+}
+
+/*
+ * Time-lapse export.  Workers take frame numbers in order, draw and
+ * encode each into memory, and leave it in its slot of a ring; the
+ * writer (the calling thread) writes the slots out in frame order.
+ * Workers can't get more than the ring's size ahead of the writer,
+ * so memory stays bounded however slow the disk is.
+ */
+
+typedef struct {
+    char* data;             /* encoded frame, 0 until it's ready */
+    size_t len;
+} FrameSlot;
+
+typedef struct {
+    const MoonContext* proto;
+    int ppm;
+    time_t start;
+    long step;
+    int nframes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    FrameSlot* ring;
+    int ringSize;
+    int next;               /* next frame to hand to a worker */
+    int written;            /* frames written so far */
+    int failed;
+} Export;
+
+static void* ExportWorker(void* data)
+{
+    Export* ex = data;
+    MoonContext* ctx = calloc(1, sizeof *ctx);
+    unsigned int* pixels = malloc(ex->proto->diam * ex->proto->diam
+                                  * sizeof *pixels);
+    PngBuffers pb = { 0 };
+
+    if (ctx)
+    {
+        ctx->diam = ex->proto->diam;
+        ctx->renderMode = ex->proto->renderMode;
+        ctx->earthshine = ex->proto->earthshine;
+    }
+
+    for (;;)
+    {
+        FrameSlot slot = { 0, 0 };
+        FILE* mem;
+        int frame, ok;
+
+        pthread_mutex_lock(&ex->lock);
+        while (!ex->failed && ex->next < ex->nframes
+               && ex->next >= ex->written + ex->ringSize)
+            pthread_cond_wait(&ex->changed, &ex->lock);
+        frame = ex->failed ? ex->nframes : ex->next++;
+        pthread_mutex_unlock(&ex->lock);
+        if (frame >= ex->nframes)
+            break;
+
+        ok = ctx && pixels
+            && RenderMoonImage(ctx, ex->start + frame * ex->step,
+                               pixels) == 0
+            && (mem = open_memstream(&slot.data, &slot.len)) != 0;
+        if (ok)
+        {
+            ok = (ex->ppm ? WritePPM(mem, pixels, ctx->diam)
+                          : WritePNG(mem, pixels, ctx->diam, &pb)) == 0;
+            ok = fclose(mem) == 0 && ok;
+        }
+
+        pthread_mutex_lock(&ex->lock);
+        if (ok)
+            ex->ring[frame % ex->ringSize] = slot;
+        else
+        {
+            free(slot.data);
+            ex->failed = 1;
+        }
+        pthread_cond_broadcast(&ex->changed);
+        pthread_mutex_unlock(&ex->lock);
+    }
+
+    FreePngBuffers(&pb);
+    free(pixels);
+    if (ctx)
+    {
+        FreeImageState(ctx);
+        FreeShadeCache(ctx->shade);
+        free(ctx);
+    }
+    return 0;
+}
+
+/* Write one frame: to its own file named by pattern, or appended to
+ * stdout if pattern is "-".
+ */
+static int WriteFrame(const char* pattern, int frame, const FrameSlot* slot)
+{
+    char path[4096];
+    FILE* fp;
+
+    if (!strcmp(pattern, "-"))
+        return fwrite(slot->data, 1, slot->len, stdout) == slot->len
+            ? 0 : -1;
+    if (snprintf(path, sizeof path, pattern, frame) >= (int)sizeof path)
+        return -1;
+    if (!(fp = fopen(path, "wb")))
+        return -1;
+    if (fwrite(slot->data, 1, slot->len, fp) != slot->len)
+    {
+        fclose(fp);
+        return -1;
+    }
+    return fclose(fp);
+}
+
+/* Does pattern have exactly one conversion, a %d with optional
+ * zero padding and width, for the frame number?
+ */
+static int IsFramePattern(const char* pattern)
+{
+    int conversions = 0;
+    const char* p;
+
+    for (p = pattern; *p; ++p)
+    {
+        if (*p != '%')
+            continue;
+        ++p;
+        if (*p == '%')
+            continue;
+        while (*p >= '0' && *p <= '9')
+            ++p;
+        if (*p != 'd')
+            return 0;
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+/* Draw nframes moons, step seconds apart from start, with proto's
+ * size and shading, on nthreads threads.  pattern names each frame's
+ * file, printf-style with its number (frame%04d.png), with the format
+ * as for WriteMoonImage, or is "-" for all of them one after another
+ * on stdout as PPM, a stream ffmpeg's image2pipe reads.  *writeWait
+ * gets how long the writer spent waiting for frames, in microseconds.
+ * Returns 0 on success.
+ */
+int ExportFrames(const MoonContext* proto, const char* pattern,
+                 time_t start, long step, int nframes, int nthreads,
+                 double* writeWait)
+{
+    Export ex;
+    pthread_t* threads;
+    int i, started = 0;
+
+    if (strcmp(pattern, "-") && !IsFramePattern(pattern))
+    {
+        fprintf(stderr, "moonroot: %s needs one %%d for the frame number\n",
+                pattern);
+        return -1;
+    }
+
+    memset(&ex, 0, sizeof ex);
+    ex.proto = proto;
+    ex.ppm = !strcmp(pattern, "-") || IsPPMName(pattern);
+    ex.start = start;
+    ex.step = step;
+    ex.nframes = nframes;
+    ex.ringSize = 2 * nthreads;
+    ex.ring = calloc(ex.ringSize, sizeof *ex.ring);
+    threads = calloc(nthreads, sizeof *threads);
+    pthread_mutex_init(&ex.lock, 0);
+    pthread_cond_init(&ex.changed, 0);
+    *writeWait = 0.;
+
+    if (ex.ring && threads)
+        for (i = 0; i < nthreads; ++i)
+            if (pthread_create(&threads[started], 0, ExportWorker, &ex) == 0)
+                ++started;
+    if (!started)
+        ex.failed = 1;
+
+    while (!ex.failed && ex.written < nframes)
+    {
+        FrameSlot* slot = &ex.ring[ex.written % ex.ringSize];
+        double waitStart = StatsClock();
+        int ok;
+
+        pthread_mutex_lock(&ex.lock);
+        while (!slot->data && !ex.failed)
+            pthread_cond_wait(&ex.changed, &ex.lock);
+        pthread_mutex_unlock(&ex.lock);
+        *writeWait += StatsClock() - waitStart;
+        if (!slot->data)
+            break;
+
+        /* The slot is the writer's until written moves past it */
+        ok = WriteFrame(pattern, ex.written, slot) == 0;
+        free(slot->data);
+
+        pthread_mutex_lock(&ex.lock);
+        slot->data = 0;
+        if (ok)
+            ++ex.written;
+        else
+        {
+            perror(pattern);
+            ex.failed = 1;
+        }
+        pthread_cond_broadcast(&ex.changed);
+        pthread_mutex_unlock(&ex.lock);
+    }
+
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], 0);
+    for (i = 0; ex.ring && i < ex.ringSize; ++i)
+        free(ex.ring[i].data);
+    free(ex.ring);
+    free(threads);
+    pthread_mutex_destroy(&ex.lock);
+    pthread_cond_destroy(&ex.changed);
+    if (!strcmp(pattern, "-") && fflush(stdout) != 0)
+        return -1;
+    return ex.failed ? -1 : 0;
+}
@@ -0,0 +1,1025 @@
+/*
+ * moonimage.c: the moon images, and getting them onto the X server.
+ *
+ * The images are converted from XPM at build time by xpm2c,
+ * so at runtime all we have to do is push pixels with XPutImage.
+ * On TrueColor displays the full-size moon comes instead from the
+ * 8-bit-per-channel RGB data in fullmoon.h, which is much finer than
+ * the XPM's palette; that gets decoded straight into native pixels.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>     // for getpid
+#include <sys/stat.h>   // for mkdir
+#include <X11/Xutil.h>
+
+#include "moonpixel.h"
+#include "fullmoon.h"
+#include "fullmoon100_img.h"
+#include "fullmoon174_img.h"
+
+typedef struct {
+    unsigned int diam;
+    const unsigned int* pixels;     /* 0x00RRGGBB */
+    const unsigned char* mask;      /* XBM bitmap */
+} EmbeddedMoon;
+
+static EmbeddedMoon embeddedMoons[] = {
+    { 174, fullmoon174_pixels, fullmoon174_mask },
+    { 100, fullmoon100_pixels, fullmoon100_mask },
+};
+#define NUM_EMBEDDED (sizeof embeddedMoons / sizeof embeddedMoons[0])
+
+static void MaskToShift(unsigned long mask, int* shift, int* loss)
+{
+    int bits = 0;
+
+    for (*shift = 0; mask && !(mask & 1); mask >>= 1)
+        ++*shift;
+    for ( ; mask & 1; mask >>= 1)
+        ++bits;
+    if (bits >= 8)
+    {
+        *shift += bits - 8;
+        *loss = 0;
+    }
+    else
+        *loss = 8 - bits;
+}
+
+void GetPixelFormat(Visual* vis, int depth, PixelFormat* pf)
+{
+    MaskToShift(vis->red_mask, &pf->rshift, &pf->rloss);
+    MaskToShift(vis->green_mask, &pf->gshift, &pf->gloss);
+    MaskToShift(vis->blue_mask, &pf->bshift, &pf->bloss);
+
+    /* The ARGB visuals compositing managers use: alpha in the top byte */
+    if (depth == 32
+        && (vis->red_mask | vis->green_mask | vis->blue_mask) == 0xffffff)
+        pf->ashift = 24;
+    else
+        pf->ashift = -1;
+}
+
+/* The GIMP header format packs each RGB pixel into 4 printable chars,
+ * 6 bits apiece, offset by 33 (see HEADER_PIXEL in fullmoon.h).
+ * Decode npixels of it into native pixels in out.
+ *
+ * Vectorized, 64 chars are loaded as 16 32-bit lanes, each holding
+ * one pixel's 4 chars, so unpacking the channels is just shifts
+ * and masks across the whole vector.
+ */
+#ifdef USE_VECTORS
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CHAR0 0
+#define CHAR1 8
+#define CHAR2 16
+#define CHAR3 24
+#else
+#define CHAR0 24
+#define CHAR1 16
+#define CHAR2 8
+#define CHAR3 0
+#endif
+#endif
+
+static void DecodeGimpPixels(const char* data, unsigned int* out,
+                             int npixels, const PixelFormat* pf)
+{
+    unsigned char pixel[3];
+    int i = 0;
+
+#ifdef USE_VECTORS
+    for ( ; i + 16 <= npixels; i += 16)
+    {
+        v16u w, c0, c1, c2, c3, r, g, b;
+
+        memcpy(&w, data, sizeof w);
+        data += sizeof w;
+        w -= 0x21212121;            /* every char is >= 33: no borrows */
+        c0 = (w >> CHAR0) & 0x3f;
+        c1 = (w >> CHAR1) & 0x3f;
+        c2 = (w >> CHAR2) & 0x3f;
+        c3 = (w >> CHAR3) & 0x3f;
+        r = (c0 << 2) | (c1 >> 4);
+        g = ((c1 & 0xf) << 4) | (c2 >> 2);
+        b = ((c2 & 0x3) << 6) | c3;
+        w = PACK_PIXEL(r, g, b, pf);
+        memcpy(out + i, &w, sizeof w);
+    }
+#endif
+
+    for ( ; i < npixels; ++i)
+    {
+        HEADER_PIXEL(data, pixel);
+        out[i] = PACK_PIXEL(pixel[0], pixel[1], pixel[2], pf);
+    }
+}
+
+/* Convert npixels of 0x00RRGGBB into native pixels. */
+void PackPixels(const unsigned int* rgb, unsigned int* out,
+                       int npixels, const PixelFormat* pf)
+{
+    int i = 0;
+
+#ifdef USE_VECTORS
+    for ( ; i + 16 <= npixels; i += 16)
+    {
+        v16u w;
+
+        memcpy(&w, rgb + i, sizeof w);
+        w = PACK_PIXEL((w >> 16) & 0xff, (w >> 8) & 0xff, w & 0xff, pf);
+        memcpy(out + i, &w, sizeof w);
+    }
+#endif
+
+    for ( ; i < npixels; ++i)
+        out[i] = PACK_PIXEL((rgb[i] >> 16) & 0xff, (rgb[i] >> 8) & 0xff,
+                            rgb[i] & 0xff, pf);
+}
+
+/* Can an array of 32-bit words be handed to XPutImage as this
+ * image's data, without any repacking?
+ */
+int IsNativeWords(XImage* img)
+{
+    union { unsigned int i; char c; } endian = { 1 };
+    int hostOrder = endian.c ? LSBFirst : MSBFirst;
+
+    return img->bits_per_pixel == 32
+        && img->byte_order == hostOrder
+        && img->bytes_per_line == img->width * 4;
+}
+
+/* Is this visual's pixel layout exactly our 0x00RRGGBB words,
+ * so the embedded array can be handed to XPutImage as-is?
+ */
+static int IsNativeRGB(XImage* img, Visual* vis)
+{
+    return vis->class == TrueColor
+        && IsNativeWords(img)
+        && vis->red_mask == 0xff0000
+        && vis->green_mask == 0xff00
+        && vis->blue_mask == 0xff;
+}
+
+#define MAX_CACHED_COLOURS 1024
+
+/* A moon as premultiplied ARGB, for drawing on the CPU, shared by
+ * every context showing a moon of that size.
+ */
+typedef struct SharedARGB {
+    struct SharedARGB* next;
+    unsigned int diam;
+    unsigned int* argb;
+    int refs;
+    int building;           /* being made, with imageLock let go */
+} SharedARGB;
+
+static SharedARGB* sharedARGB = 0;
+
+/* Moon pixmaps on a server, shared by every window on that screen
+ * showing a moon of the same size.
+ */
+typedef struct SharedPixmaps {
+    struct SharedPixmaps* next;
+    Display* dpy;
+    int screen;
+    unsigned int diam;
+    Pixmap pix, mask;
+    int refs;
+} SharedPixmaps;
+
+static SharedPixmaps* sharedPixmaps = 0;
+
+/* Displays can be served from several threads: this guards both
+ * lists.  Moons are made (read from the disk cache, or resampled)
+ * with it let go, so one display's new size doesn't hold up the
+ * others: the new entry is listed first, marked building, and
+ * threads wanting the same size wait on imageBuilt for it.
+ */
+static pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t imageBuilt = PTHREAD_COND_INITIALIZER;
+
+/* A context's images on the CPU side */
+struct ImageState {
+    /* The moon at the size last asked for */
+    SharedARGB* moon;
+
+    /* Colours allocated on a visual we can't write directly */
+    struct { unsigned int rgb; unsigned long pixel; }
+        colours[MAX_CACHED_COLOURS];
+    int ncolours;
+};
+
+static struct ImageState* GetImageState(MoonContext* ctx)
+{
+    if (!ctx->image)
+        ctx->image = calloc(1, sizeof *ctx->image);
+    return ctx->image;
+}
+
+/* Map an 0xRRGGBB colour to a pixel value on a visual we can't
+ * write directly.  Colours are remembered so each is allocated once.
+ */
+static unsigned long LookupPixel(MoonContext* ctx, unsigned int rgb)
+{
+    Display* dpy = ctx->dpy;
+    struct ImageState* is = GetImageState(ctx);
+    XColor xc;
+    int i;
+
+    if (is)
+        for (i = 0; i < is->ncolours; ++i)
+            if (is->colours[i].rgb == rgb)
+                return is->colours[i].pixel;
+
+    xc.red   = ((rgb >> 16) & 0xff) * 0x101;
+    xc.green = ((rgb >> 8) & 0xff) * 0x101;
+    xc.blue  = (rgb & 0xff) * 0x101;
+    xc.flags = DoRed | DoGreen | DoBlue;
+    TraceRoundTrip(dpy, "XAllocColor");
+    if (!XAllocColor(dpy, DefaultColormap(dpy, ctx->screen), &xc))
+        xc.pixel = (rgb & 0x808080) ? WhitePixel(dpy, ctx->screen)
+                                    : BlackPixel(dpy, ctx->screen);
+    if (is && is->ncolours < MAX_CACHED_COLOURS)
+    {
+        is->colours[is->ncolours].rgb = rgb;
+        is->colours[is->ncolours++].pixel = xc.pixel;
+    }
+    return xc.pixel;
+}
+
+/*
+ * Arbitrary sizes are resampled from the full-size master image,
+ * kept as premultiplied 0xAARRGGBB, and cached on disk by size.
+ * For shrinking, the master has a mipmap pyramid, each level half
+ * the size of the one above, and the resample starts from the
+ * smallest level that's still at least as big as the target.
+ */
+
+#define CACHE_MAGIC "MOONARGB"
+#define CACHE_VERSION 2
+
+#define MAX_MIP_LEVELS 12
+#define MIN_MIP_DIAM 8
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int diam;
+    unsigned int mastersum;     /* detects a changed master image */
+} CacheHeader;
+
+static unsigned int* masterMoon = 0;
+static unsigned int masterDiam = 0;
+static unsigned int masterSum = 0;
+
+static unsigned int* mipLevels[MAX_MIP_LEVELS];
+static unsigned int mipDiams[MAX_MIP_LEVELS];
+static int numMipLevels = 0;
+
+/* How many times a moon has been resampled: resizing should be cheap.
+ * Counted atomically: resampling runs without imageLock.
+ */
+int moonResamples = 0;
+
+/* Shrink an odd-sized premultiplied ARGB image to srcdiam / 2.
+ * Each pixel is the area-weighted mean of the srcdiam / diam square
+ * of source it covers, so the last row and column count too and the
+ * moon keeps its size and centre.
+ */
+static unsigned int* ShrinkOddMoon(const unsigned int* src,
+                                   unsigned int srcdiam, unsigned int diam)
+{
+    unsigned int* dst = malloc(diam * diam * sizeof *dst);
+    double scale = (double)srcdiam / diam;
+    unsigned int x, y, sx, sy, c;
+
+    if (!dst)
+        return 0;
+    for (y = 0; y < diam; ++y)
+    {
+        double y0 = y * scale, y1 = (y + 1) * scale;
+
+        for (x = 0; x < diam; ++x)
+        {
+            double x0 = x * scale, x1 = (x + 1) * scale;
+            double sum[4] = { 0., 0., 0., 0. };
+            unsigned int out = 0;
+
+            for (sy = (unsigned int)y0; sy < y1 && sy < srcdiam; ++sy)
+            {
+                double wy = (sy + 1 < y1 ? sy + 1 : y1) - (sy > y0 ? sy : y0);
+
+                for (sx = (unsigned int)x0; sx < x1 && sx < srcdiam; ++sx)
+                {
+                    double w = wy * ((sx + 1 < x1 ? sx + 1 : x1)
+                                     - (sx > x0 ? sx : x0));
+                    unsigned int p = src[sy*srcdiam + sx];
+
+                    for (c = 0; c < 4; ++c)
+                        sum[c] += w * ((p >> (8*c)) & 0xff);
+                }
+            }
+            for (c = 0; c < 4; ++c)
+            {
+                unsigned int v = (unsigned int)(sum[c] / (scale*scale) + .5);
+                out |= (v > 255 ? 255 : v) << (8*c);
+            }
+            dst[y*diam + x] = out;
+        }
+    }
+    return dst;
+}
+
+/* Average 2x2 blocks of a premultiplied ARGB image. */
+static unsigned int* HalveMoon(const unsigned int* src, unsigned int srcdiam)
+{
+    unsigned int diam = srcdiam / 2;
+    unsigned int* dst;
+    unsigned int x, y;
+
+    if (srcdiam & 1)
+        return ShrinkOddMoon(src, srcdiam, diam);
+    dst = malloc(diam * diam * sizeof *dst);
+    if (!dst)
+        return 0;
+    for (y = 0; y < diam; ++y)
+    {
+        const unsigned int* r0 = src + 2*y*srcdiam;
+        const unsigned int* r1 = r0 + srcdiam;
+        for (x = 0; x < diam; ++x)
+        {
+            unsigned int a = r0[2*x], b = r0[2*x+1];
+            unsigned int c = r1[2*x], d = r1[2*x+1];
+            unsigned int rb = (a & 0xff00ff) + (b & 0xff00ff)
+                            + (c & 0xff00ff) + (d & 0xff00ff) + 0x20002;
+            unsigned int ag = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff)
+                            + ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff)
+                            + 0x20002;
+            dst[y*diam + x] = ((rb >> 2) & 0xff00ff)
+                            | ((ag << 6) & 0xff00ff00);
+        }
+    }
+    return dst;
+}
+
+static void BuildMipLevels()
+{
+    mipLevels[0] = masterMoon;
+    mipDiams[0] = masterDiam;
+    for (numMipLevels = 1; numMipLevels < MAX_MIP_LEVELS; ++numMipLevels)
+    {
+        unsigned int diam = mipDiams[numMipLevels-1] / 2;
+        if (diam < MIN_MIP_DIAM)
+            break;
+        mipLevels[numMipLevels] = HalveMoon(mipLevels[numMipLevels-1],
+                                            mipDiams[numMipLevels-1]);
+        if (!mipLevels[numMipLevels])
+            break;
+        mipDiams[numMipLevels] = diam;
+    }
+}
+
+/* Decode fullmoon.h into the master image, alpha from the 174 mask. */
+static void DecodeMasterMoon()
+{
+    PixelFormat argb = { 16, 8, 0, 0, 0, 0, -1 };
+    unsigned int rowbytes = (fullmoon174Width + 7) / 8;
+    unsigned int x, y;
+
+    masterDiam = fullmoonWidth;
+    masterMoon = malloc(masterDiam * masterDiam * sizeof *masterMoon);
+    if (!masterMoon)
+        return;
+    DecodeGimpPixels(fullmoonBits, masterMoon, masterDiam * masterDiam,
+                     &argb);
+
+    for (y = 0; y < masterDiam; ++y)
+        for (x = 0; x < masterDiam; ++x)
+        {
+            unsigned int* p = masterMoon + y*masterDiam + x;
+            if (fullmoon174_mask[y*rowbytes + x/8] & (1 << (x%8)))
+                *p |= 0xff000000;
+            else
+                *p = 0;
+            masterSum = masterSum * 31 + *p;
+        }
+
+    BuildMipLevels();
+}
+
+/* The master is made once, by whichever thread first wants it,
+ * and never changes after.
+ */
+static void LoadMasterMoon()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, DecodeMasterMoon);
+}
+
+/* Bilinear resample of a square premultiplied ARGB image.
+ * Each output row first blends the two source rows it falls between
+ * (contiguous, so fully vectorized), then blends neighbouring pixels
+ * of that row for each output column.
+ */
+static unsigned int* ResampleMoon(const unsigned int* src,
+                                  int srcdiam, int diam)
+{
+    unsigned int* dst = malloc(diam * diam * sizeof *dst);
+    unsigned int* row = malloc(srcdiam * sizeof *row);
+    int* xi = malloc(diam * sizeof *xi);
+    unsigned int* xf = malloc(diam * sizeof *xf);
+    double scale = (double)srcdiam / diam;
+    int x, y;
+
+    if (!dst || !row || !xi || !xf)
+    {
+        free(dst);
+        dst = 0;
+        goto done;
+    }
+    __atomic_add_fetch(&moonResamples, 1, __ATOMIC_RELAXED);
+
+    /* Sample at pixel centres, clamped to the edges of the source. */
+    for (x = 0; x < diam; ++x)
+    {
+        double sx = (x + .5) * scale - .5;
+        if (sx < 0.)
+            sx = 0.;
+        xi[x] = (int)sx;
+        if (xi[x] >= srcdiam - 1)
+        {
+            xi[x] = srcdiam - 2;
+            sx = srcdiam - 1;
+        }
+        xf[x] = (unsigned int)((sx - xi[x]) * 256. + .5);
+    }
+
+    for (y = 0; y < diam; ++y)
+    {
+        double sy = (y + .5) * scale - .5;
+        const unsigned int *r0, *r1;
+        unsigned int* out = dst + y*diam;
+        unsigned int fy;
+        int y0, i;
+
+        if (sy < 0.)
+            sy = 0.;
+        y0 = (int)sy;
+        if (y0 >= srcdiam - 1)
+        {
+            y0 = srcdiam - 2;
+            sy = srcdiam - 1;
+        }
+        fy = (unsigned int)((sy - y0) * 256. + .5);
+        r0 = src + y0*srcdiam;
+        r1 = r0 + srcdiam;
+
+        i = 0;
+#ifdef USE_VECTORS
+        for ( ; i + 16 <= srcdiam; i += 16)
+        {
+            v16u a, b;
+            memcpy(&a, r0 + i, sizeof a);
+            memcpy(&b, r1 + i, sizeof b);
+            a = LERP_PIXEL(a, b, fy);
+            memcpy(row + i, &a, sizeof a);
+        }
+#endif
+        for ( ; i < srcdiam; ++i)
+            row[i] = LERP_PIXEL(r0[i], r1[i], fy);
+
+        x = 0;
+#ifdef USE_VECTORS
+        for ( ; x + 16 <= diam; x += 16)
+        {
+            v16u a, b, f;
+            for (i = 0; i < 16; ++i)
+            {
+                a[i] = row[xi[x+i]];
+                b[i] = row[xi[x+i] + 1];
+                f[i] = xf[x+i];
+            }
+            a = LERP_PIXEL(a, b, f);
+            memcpy(out + x, &a, sizeof a);
+        }
+#endif
+        for ( ; x < diam; ++x)
+            out[x] = LERP_PIXEL(row[xi[x]], row[xi[x] + 1], xf[x]);
+    }
+
+done:
+    free(row);
+    free(xi);
+    free(xf);
+    return dst;
+}
+
+/* Where cached images of the given size live. */
+static int CachePath(unsigned int diam, char* path, int pathlen)
+{
+    char* base = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    char dir[1024];
+
+    if (base && *base)
+        snprintf(dir, sizeof dir, "%s", base);
+    else if (home && *home)
+        snprintf(dir, sizeof dir, "%s/.cache", home);
+    else
+        return -1;
+    mkdir(dir, 0755);
+    if (strlen(dir) + sizeof "/moonroot" > sizeof dir)
+        return -1;
+    strcat(dir, "/moonroot");
+    mkdir(dir, 0755);
+
+    if (snprintf(path, pathlen, "%s/moon%u.argb", dir, diam) >= pathlen)
+        return -1;
+    return 0;
+}
+
+static unsigned int* LoadCachedMoon(unsigned int diam)
+{
+    char path[1100];
+    CacheHeader hdr;
+    unsigned int* pixels;
+    FILE* fp;
+
+    if (CachePath(diam, path, sizeof path) != 0
+        || (fp = fopen(path, "rb")) == 0)
+        return 0;
+
+    pixels = malloc(diam * diam * sizeof *pixels);
+    if (!pixels
+        || fread(&hdr, sizeof hdr, 1, fp) != 1
+        || memcmp(hdr.magic, CACHE_MAGIC, sizeof hdr.magic)
+        || hdr.version != CACHE_VERSION
+        || hdr.diam != diam
+        || hdr.mastersum != masterSum
+        || fread(pixels, sizeof *pixels, diam * diam, fp) != diam * diam)
+    {
+        free(pixels);
+        pixels = 0;
+    }
+    fclose(fp);
+    return pixels;
+}
+
+/* Write to a temporary name, then rename, so that another moonroot
+ * starting up at the same time never sees a partial file.
+ */
+static void SaveCachedMoon(const unsigned int* pixels, unsigned int diam)
+{
+    char path[1100], tmppath[1200];
+    CacheHeader hdr;
+    FILE* fp;
+    int ok;
+
+    if (CachePath(diam, path, sizeof path) != 0)
+        return;
+    snprintf(tmppath, sizeof tmppath, "%s.%d", path, (int)getpid());
+    if ((fp = fopen(tmppath, "wb")) == 0)
+        return;
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof hdr.magic);
+    hdr.version = CACHE_VERSION;
+    hdr.diam = diam;
+    hdr.mastersum = masterSum;
+    ok = fwrite(&hdr, sizeof hdr, 1, fp) == 1
+        && fwrite(pixels, sizeof *pixels, diam * diam, fp) == diam * diam;
+    if (fclose(fp) != 0 || !ok || rename(tmppath, path) != 0)
+        unlink(tmppath);
+}
+
+/* Turn premultiplied ARGB into plain 0x00RRGGBB, in place. */
+static void UnpremultiplyPixels(unsigned int* p, int npixels)
+{
+    int i;
+
+    for (i = 0; i < npixels; ++i)
+    {
+        unsigned int a = p[i] >> 24;
+
+        if (a == 0xff)
+            p[i] &= 0xffffff;
+        else if (a == 0)
+            p[i] = 0;
+        else
+        {
+            unsigned int r = ((p[i] >> 16) & 0xff) * 255 / a;
+            unsigned int g = ((p[i] >> 8) & 0xff) * 255 / a;
+            unsigned int b = (p[i] & 0xff) * 255 / a;
+            p[i] = ((r > 255 ? 255 : r) << 16) | ((g > 255 ? 255 : g) << 8)
+                | (b > 255 ? 255 : b);
+        }
+    }
+}
+
+/* XBM-style shape mask from the alpha channel. */
+static unsigned char* MaskFromAlpha(const unsigned int* argb,
+                                    unsigned int diam)
+{
+    unsigned int rowbytes = (diam + 7) / 8;
+    unsigned char* bits = calloc(rowbytes * diam, 1);
+    unsigned int x, y;
+
+    if (!bits)
+        return 0;
+    for (y = 0; y < diam; ++y)
+        for (x = 0; x < diam; ++x)
+            if ((argb[y*diam + x] >> 24) >= 0x80)
+                bits[y*rowbytes + x/8] |= 1 << (x%8);
+    return bits;
+}
+
+/* Send diam x diam pixels to a new pixmap, and the mask to a bitmap.
+ * words are native pixel values if native is set,
+ * otherwise 0x00RRGGBB colours.
+ */
+static int PutMoonPixmaps(MoonContext* ctx, unsigned int diam,
+                          const unsigned int* words, int native,
+                          const unsigned char* maskbits,
+                          Pixmap* pix, Pixmap* mask)
+{
+    Display* dpy = ctx->dpy;
+    Visual* vis = DefaultVisual(dpy, ctx->screen);
+    int depth = DefaultDepth(dpy, ctx->screen);
+    XImage* img;
+    int x, y;
+
+    img = XCreateImage(dpy, vis, depth, ZPixmap, 0, 0, diam, diam, 32, 0);
+    if (!img)
+        return -1;
+
+    if (native ? IsNativeWords(img) : IsNativeRGB(img, vis))
+        img->data = (char*)words;
+    else
+    {
+        img->data = malloc(img->bytes_per_line * diam);
+        if (!img->data)
+        {
+            XDestroyImage(img);
+            return -1;
+        }
+        for (y = 0; y < (int)diam; ++y)
+            for (x = 0; x < (int)diam; ++x)
+                XPutPixel(img, x, y,
+                          native ? words[y*diam + x]
+                                 : LookupPixel(ctx, words[y*diam + x]));
+    }
+
+    *pix = XCreatePixmap(dpy, ctx->win, diam, diam, depth);
+    XPutImage(dpy, *pix, DefaultGC(dpy, ctx->screen), img,
+              0, 0, 0, 0, diam, diam);
+
+    *mask = XCreateBitmapFromData(dpy, ctx->win, (char*)maskbits,
+                                  diam, diam);
+
+    if (img->data == (char*)words)
+        img->data = 0;      /* don't let XDestroyImage free our array */
+    XDestroyImage(img);
+
+    return 0;
+}
+
+/* Resample from the nearest mip level at least as big as diam. */
+static unsigned int* ScaleMoon(unsigned int diam)
+{
+    int level = 0;
+
+    while (level + 1 < numMipLevels && mipDiams[level+1] >= diam)
+        ++level;
+    return ResampleMoon(mipLevels[level], mipDiams[level], diam);
+}
+
+/* The functions on the shared lists expect imageLock to be held. */
+static SharedARGB* FindMoonARGB(unsigned int diam)
+{
+    SharedARGB* sa;
+
+    for (sa = sharedARGB; sa; sa = sa->next)
+        if (sa->diam == diam)
+            return sa;
+    return 0;
+}
+
+static void ReleaseMoonARGB(SharedARGB* sa)
+{
+    SharedARGB** link;
+
+    if (!sa || --sa->refs > 0)
+        return;
+    for (link = &sharedARGB; *link; link = &(*link)->next)
+        if (*link == sa)
+        {
+            *link = sa->next;
+            break;
+        }
+    free(sa->argb);
+    free(sa);
+}
+
+/* Have the context hold sa, letting go of the moon it held before. */
+static const unsigned int* HoldMoonARGB(MoonContext* ctx, SharedARGB* sa)
+{
+    struct ImageState* is = GetImageState(ctx);
+
+    if (!is)
+        return 0;
+    if (is->moon != sa)
+    {
+        ++sa->refs;
+        ReleaseMoonARGB(is->moon);
+        is->moon = sa;
+    }
+    return sa->argb;
+}
+
+/* Make the moon at a size no one shares yet: from an embedded image,
+ * the disk cache (if loadCache) or a resample, which goes in the
+ * cache if saveCache.  Runs without imageLock.
+ */
+static unsigned int* MakeMoonARGB(unsigned int diam, int loadCache,
+                                  int saveCache)
+{
+    unsigned int* argb = 0;
+    unsigned int i, x, y;
+
+    for (i = 0; i < NUM_EMBEDDED; ++i)
+        if (embeddedMoons[i].diam == diam)
+            break;
+    if (i < NUM_EMBEDDED)
+    {
+        unsigned int rowbytes = (diam + 7) / 8;
+
+        argb = malloc(diam * diam * sizeof *argb);
+        if (!argb)
+            return 0;
+        for (y = 0; y < diam; ++y)
+            for (x = 0; x < diam; ++x)
+                argb[y*diam + x] =
+                    (embeddedMoons[i].mask[y*rowbytes + x/8] & (1 << (x%8)))
+                    ? embeddedMoons[i].pixels[y*diam + x] | 0xff000000 : 0;
+        return argb;
+    }
+
+    if (loadCache)
+        argb = LoadCachedMoon(diam);
+    if (!argb)
+    {
+        argb = ScaleMoon(diam);
+        if (argb && saveCache)
+            SaveCachedMoon(argb, diam);
+    }
+    return argb;
+}
+
+/* The shared moon of this size, made if no one has it yet, and held
+ * for ctx.  Called with imageLock held, which is let go while the
+ * moon is made; another thread wanting the same size meanwhile waits
+ * for this one instead of making its own.
+ */
+static const unsigned int* ShareMoonARGB(MoonContext* ctx,
+                                         unsigned int diam,
+                                         int loadCache, int saveCache)
+{
+    SharedARGB* sa;
+    unsigned int* argb;
+
+    while ((sa = FindMoonARGB(diam)) != 0 && sa->building)
+        pthread_cond_wait(&imageBuilt, &imageLock);
+    if (sa)
+        return HoldMoonARGB(ctx, sa);
+
+    sa = calloc(1, sizeof *sa);
+    if (!sa)
+        return 0;
+    sa->diam = diam;
+    sa->building = 1;
+    sa->next = sharedARGB;
+    sharedARGB = sa;
+
+    pthread_mutex_unlock(&imageLock);
+    argb = MakeMoonARGB(diam, loadCache, saveCache);
+    pthread_mutex_lock(&imageLock);
+
+    sa->argb = argb;
+    sa->building = 0;
+    pthread_cond_broadcast(&imageBuilt);
+    if (!argb)
+    {
+        /* Unlisted: a waiter will try for itself */
+        ++sa->refs;
+        ReleaseMoonARGB(sa);
+        return 0;
+    }
+    return HoldMoonARGB(ctx, sa);
+}
+
+void FreeImageState(MoonContext* ctx)
+{
+    if (!ctx->image)
+        return;
+    pthread_mutex_lock(&imageLock);
+    ReleaseMoonARGB(ctx->image->moon);
+    pthread_mutex_unlock(&imageLock);
+    free(ctx->image);
+    ctx->image = 0;
+}
+
+/* Make a moon of a size we have no embedded image for.
+ * Only sizes asked for by the user go in the disk cache:
+ * interactive resizing would fill it with sizes never seen again.
+ */
+static int CreateScaledMoonPixmaps(MoonContext* ctx, unsigned int diam,
+                                   int useCache, Pixmap* pix, Pixmap* mask)
+{
+    Visual* vis = DefaultVisual(ctx->dpy, ctx->screen);
+    const unsigned int* argb;
+    unsigned int* words;
+    unsigned char* maskbits;
+    int rv = -1;
+
+    LoadMasterMoon();
+    if (!masterMoon)
+        return -1;
+
+    /* Another window may already have made this size */
+    pthread_mutex_lock(&imageLock);
+    argb = ShareMoonARGB(ctx, diam, useCache, useCache);
+    pthread_mutex_unlock(&imageLock);
+    if (!argb)
+        return -1;
+
+    words = malloc(diam * diam * sizeof *words);
+    maskbits = MaskFromAlpha(argb, diam);
+    if (words && maskbits)
+    {
+        memcpy(words, argb, diam * diam * sizeof *words);
+        UnpremultiplyPixels(words, diam * diam);
+        if (vis->class == TrueColor)
+        {
+            PixelFormat pf;
+            GetPixelFormat(vis, DefaultDepth(ctx->dpy, ctx->screen), &pf);
+            PackPixels(words, words, diam * diam, &pf);
+            rv = PutMoonPixmaps(ctx, diam, words, 1, maskbits, pix, mask);
+        }
+        else
+            rv = PutMoonPixmaps(ctx, diam, words, 0, maskbits, pix, mask);
+    }
+
+    free(maskbits);
+    free(words);
+    return rv;
+}
+
+/* The moon as premultiplied ARGB at the given diameter,
+ * from the master, an embedded image or a resample, in that order.
+ * Contexts showing the same size share one copy.
+ * The result stays valid until a moon of a different size is made
+ * in the same context.
+ */
+const unsigned int* GetMoonARGB(MoonContext* ctx, unsigned int diam)
+{
+    const unsigned int* argb;
+
+    if (ctx->image && ctx->image->moon && ctx->image->moon->diam == diam)
+        return ctx->image->moon->argb;
+
+    LoadMasterMoon();
+    if (!masterMoon)
+        return 0;
+    if (diam == masterDiam)
+        return masterMoon;
+
+    pthread_mutex_lock(&imageLock);
+    argb = ShareMoonARGB(ctx, diam, 1, 0);
+    pthread_mutex_unlock(&imageLock);
+    return argb;
+}
+
+/* Upload a moon image of the given diameter to the server. */
+static int UploadMoonPixmaps(MoonContext* ctx, unsigned int diam,
+                             int useCache, Pixmap* pix, Pixmap* mask)
+{
+    Visual* vis = DefaultVisual(ctx->dpy, ctx->screen);
+    EmbeddedMoon* moon = 0;
+    PixelFormat pf;
+    unsigned int* words;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < NUM_EMBEDDED; ++i)
+        if (embeddedMoons[i].diam == diam)
+            moon = &embeddedMoons[i];
+    if (!moon)
+        return CreateScaledMoonPixmaps(ctx, diam, useCache, pix, mask);
+
+    if (vis->class != TrueColor || diam != fullmoonWidth
+        || diam != fullmoonHeight)
+        return PutMoonPixmaps(ctx, diam, moon->pixels, 0, moon->mask,
+                              pix, mask);
+
+    /* Full-colour GIMP data, decoded to native pixels. */
+    words = malloc(diam * diam * sizeof *words);
+    if (!words)
+        return -1;
+    GetPixelFormat(vis, DefaultDepth(ctx->dpy, ctx->screen), &pf);
+    DecodeGimpPixels(fullmoonBits, words, diam * diam, &pf);
+    rv = PutMoonPixmaps(ctx, diam, words, 1, moon->mask, pix, mask);
+    free(words);
+    return rv;
+}
+
+/* The moon pixmap and its shape mask at the given diameter,
+ * uploaded to the server unless another window on the same screen
+ * already has them.  Give them back with ReleaseMoonPixmaps.
+ * useCache says whether a resampled moon may come from or go to
+ * the disk cache.
+ * Returns 0 on success.
+ */
+int CreateMoonPixmaps(MoonContext* ctx, unsigned int diam, int useCache,
+                      Pixmap* pix, Pixmap* mask)
+{
+    SharedPixmaps* sp;
+
+    /* Only this display's thread adds its entries, so no other thread
+     * can upload the same ones while the lock is let go.
+     */
+    pthread_mutex_lock(&imageLock);
+    for (sp = sharedPixmaps; sp; sp = sp->next)
+        if (sp->dpy == ctx->dpy && sp->screen == ctx->screen
+            && sp->diam == diam)
+            break;
+    if (sp)
+        ++sp->refs;
+    pthread_mutex_unlock(&imageLock);
+
+    if (!sp)
+    {
+        sp = calloc(1, sizeof *sp);
+        if (!sp)
+            return -1;
+        if (UploadMoonPixmaps(ctx, diam, useCache, &sp->pix, &sp->mask))
+        {
+            free(sp);
+            return -1;
+        }
+        sp->dpy = ctx->dpy;
+        sp->screen = ctx->screen;
+        sp->diam = diam;
+        sp->refs = 1;
+        pthread_mutex_lock(&imageLock);
+        sp->next = sharedPixmaps;
+        sharedPixmaps = sp;
+        pthread_mutex_unlock(&imageLock);
+    }
+    *pix = sp->pix;
+    *mask = sp->mask;
+    return 0;
+}
+
+/* Done with a moon pixmap from CreateMoonPixmaps: the pixmaps are
+ * freed when no window uses them any more.
+ */
+void ReleaseMoonPixmaps(MoonContext* ctx, Pixmap pix)
+{
+    SharedPixmaps** link;
+    SharedPixmaps* unused = 0;
+
+    pthread_mutex_lock(&imageLock);
+    for (link = &sharedPixmaps; *link; link = &(*link)->next)
+    {
+        SharedPixmaps* sp = *link;
+
+        if (sp->dpy != ctx->dpy || sp->pix != pix)
+            continue;
+        if (--sp->refs == 0)
+        {
+            *link = sp->next;
+            unused = sp;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&imageLock);
+
+    if (unused)
+    {
+        XFreePixmap(unused->dpy, unused->pix);
+        XFreePixmap(unused->dpy, unused->mask);
+        free(unused);
+    }
+}
@@ -0,0 +1,250 @@
+/*
+ * moonloop.c: moonroot's event loop.
+ *
+ * One epoll set watches everything moonroot waits on: the X
+ * connection, timers, signals and any control sockets.  Each file
+ * descriptor has a callback, run when it's readable.
+ *
+ * The loop belongs to the thread that runs it: a program serving
+ * several displays runs one loop per thread, and WatchFd and friends
+ * act on the calling thread's loop.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define MAX_WATCHES 32
+
+/* A slot can be freed and taken for another fd while events for its
+ * old one are still waiting in the batch epoll_wait returned, so each
+ * event carries the slot and its generation, and a stale one is
+ * dropped.
+ */
+typedef struct {
+    int fd;
+    WatchProc proc;
+    void* data;
+    unsigned int generation;    /* bumped each time the slot is taken */
+} Watch;
+
+static __thread int epollFd = -1;
+static __thread Watch watches[MAX_WATCHES];
+static __thread int numWatches = 0;
+static __thread WatchProc prepareProc = 0;
+static __thread void* prepareData = 0;
+static __thread int quitting = 0;
+
+/* How many times epoll_wait has returned, in every thread */
+unsigned long loopWakeups = 0;
+
+static int InitLoop()
+{
+    if (epollFd < 0)
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+    return epollFd < 0 ? -1 : 0;
+}
+
+/* Call proc(fd, data) whenever fd is readable.  Returns 0 on success. */
+int WatchFd(int fd, WatchProc proc, void* data)
+{
+    struct epoll_event ev;
+    int i;
+
+    if (InitLoop() != 0)
+        return -1;
+
+    /* Reuse a slot UnwatchFd freed, else take a new one */
+    for (i = 0; i < numWatches; ++i)
+        if (!watches[i].proc)
+            break;
+    if (i >= MAX_WATCHES)
+        return -1;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.u64 = (unsigned long long)(watches[i].generation + 1) << 32 | i;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return -1;
+    ++watches[i].generation;
+    watches[i].fd = fd;
+    watches[i].proc = proc;
+    watches[i].data = data;
+    if (i == numWatches)
+        ++numWatches;
+    return 0;
+}
+
+/* Stop watching fd.  Doesn't close it.
+ * Safe to call from a callback, even for another fd that's ready.
+ */
+void UnwatchFd(int fd)
+{
+    int i;
+
+    for (i = 0; i < numWatches; ++i)
+        if (watches[i].proc && watches[i].fd == fd)
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, 0);
+            watches[i].proc = 0;
+            watches[i].fd = -1;
+        }
+}
+
+/* Call proc(-1, data) each time round the loop, before sleeping:
+ * for work that doesn't show up on a file descriptor, such as
+ * events already sitting in Xlib's queue.
+ */
+void SetPrepareProc(WatchProc proc, void* data)
+{
+    prepareProc = proc;
+    prepareData = data;
+}
+
+/* A timer that calls proc when it goes off; set it with SetTimer.
+ * Returns its file descriptor, or -1.
+ */
+int CreateTimer(WatchProc proc, void* data)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (WatchFd(fd, proc, data) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Go off in ms milliseconds, then every interval ms if that isn't 0.
+ * ms == 0 stops the timer.  Setting a timer again restarts it.
+ */
+void SetTimer(int fd, unsigned long ms, unsigned long interval)
+{
+    SetTimerUs(fd, ms * 1000, interval * 1000);
+}
+
+/* SetTimer in microseconds, for frame rates that aren't whole ms */
+void SetTimerUs(int fd, unsigned long us, unsigned long interval)
+{
+    struct itimerspec its;
+
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000;
+    its.it_interval.tv_sec = interval / 1000000;
+    its.it_interval.tv_nsec = (interval % 1000000) * 1000;
+    timerfd_settime(fd, 0, &its, 0);
+}
+
+/* Read a timer that went off, so it stops being readable.
+ * Returns how many times it has gone off since the last read.
+ */
+unsigned long ReadTimer(int fd)
+{
+    unsigned long long expirations = 0;
+
+    if (read(fd, &expirations, sizeof expirations) != sizeof expirations)
+        return 0;
+    return (unsigned long)expirations;
+}
+
+/* Deliver the signals in sigs (ended by 0) to proc through a file
+ * descriptor instead of as interrupts.  proc reads the
+ * struct signalfd_siginfo.  Returns the descriptor, or -1.
+ */
+int WatchSignals(const int* sigs, WatchProc proc, void* data)
+{
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    for ( ; *sigs; ++sigs)
+        sigaddset(&mask, *sigs);
+    if (sigprocmask(SIG_BLOCK, &mask, 0) != 0)
+        return -1;
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (WatchFd(fd, proc, data) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Stop watching everything and let go of this thread's loop,
+ * for a thread that's finishing.  Doesn't close the watched fds.
+ */
+void CloseLoop()
+{
+    if (epollFd >= 0)
+        close(epollFd);
+    epollFd = -1;
+    numWatches = 0;
+    prepareProc = 0;
+    prepareData = 0;
+    quitting = 0;
+}
+
+/* Make this thread's RunLoop return once the current callbacks
+ * are done.
+ */
+void QuitLoop()
+{
+    quitting = 1;
+}
+
+/* Wait for things to happen and dispatch them, until QuitLoop.
+ * Returns 0, or -1 if waiting failed.
+ */
+int RunLoop()
+{
+    struct epoll_event events[MAX_WATCHES];
+
+    if (InitLoop() != 0)
+        return -1;
+
+    while (!quitting)
+    {
+        int n, i;
+
+        if (prepareProc)
+        {
+            prepareProc(-1, prepareData);
+            if (quitting)
+                break;
+        }
+
+        n = epoll_wait(epollFd, events, MAX_WATCHES, -1);
+        __atomic_add_fetch(&loopWakeups, 1, __ATOMIC_RELAXED);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
+        }
+
+        for (i = 0; i < n && !quitting; ++i)
+        {
+            Watch* w = &watches[events[i].data.u64 & 0xffffffff];
+            if (w->proc && w->generation == events[i].data.u64 >> 32)
+                w->proc(w->fd, w->data);
+        }
+    }
+    return 0;
+}
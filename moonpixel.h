@@ -0,0 +1,80 @@
+/*
+ * moonpixel.h: pixel formats and per-pixel helpers shared by
+ * moonroot's CPU-side image code.
+ *
+ * Images on the CPU side are premultiplied 0xAARRGGBB words.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#ifndef MOONPIXEL_H
+#define MOONPIXEL_H
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+/* How to build a native pixel for a TrueColor visual from 8-bit channels:
+ * ((chan >> loss) << shift), ORed together.
+ * Visuals with an alpha channel (depth 32) have it at ashift, else -1.
+ */
+typedef struct {
+    int rshift, gshift, bshift;
+    int rloss, gloss, bloss;
+    int ashift;
+} PixelFormat;
+
+#define PACK_PIXEL(r, g, b, pf) \
+    ((((r) >> (pf)->rloss) << (pf)->rshift) \
+     | (((g) >> (pf)->gloss) << (pf)->gshift) \
+     | (((b) >> (pf)->bloss) << (pf)->bshift))
+
+/* Blend two 0xAARRGGBB pixels: (a*(256-f) + b*f) / 256 per channel,
+ * two channels at a time in each 32-bit word.
+ * Works on single pixels or on whole vectors of them.
+ */
+#define LERP_PIXEL(a, b, f) \
+    ((((((a) & 0xff00ff) * (256 - (f)) + ((b) & 0xff00ff) * (f)) >> 8) \
+      & 0xff00ff) \
+     | (((((a) >> 8) & 0xff00ff) * (256 - (f)) \
+         + (((b) >> 8) & 0xff00ff) * (f)) & 0xff00ff00))
+
+/* Scale all four channels of a pixel by f/256, f in 0..256. */
+#define SCALE_PIXEL(p, f) \
+    (((((p) & 0xff00ff) * (f) >> 8) & 0xff00ff) \
+     | ((((p) >> 8) & 0xff00ff) * (f) & 0xff00ff00))
+
+/* With gcc or clang, pixel loops run 16 pixels per step,
+ * one pixel per 32-bit lane.
+ */
+#if defined(__BYTE_ORDER__) \
+    && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 9))
+#define USE_VECTORS
+typedef unsigned int v16u __attribute__((vector_size(64)));
+typedef int v16i __attribute__((vector_size(64)));
+typedef float v16f __attribute__((vector_size(64)));
+typedef unsigned char v16b __attribute__((vector_size(16)));
+#endif
+
+extern void GetPixelFormat(Visual* vis, int depth, PixelFormat* pf);
+extern void PackPixels(const unsigned int* rgb, unsigned int* out,
+                       int npixels, const PixelFormat* pf);
+extern int IsNativeWords(XImage* img);
+
+/* moonshade.c: the scratch buffers for shading at one size */
+typedef struct ShadeCache ShadeCache;
+extern ShadeCache* NewShadeCache();
+extern void FreeShadeCache(ShadeCache* sc);
+extern void ShadeMoon(ShadeCache* sc, const unsigned int* argb,
+                      unsigned int diam, const double sun[3],
+                      double earthshine, const PixelFormat* pf,
+                      unsigned int* out);
+extern void ShadeMoonAA(ShadeCache* sc, const unsigned int* argb,
+                        unsigned int diam, const double sun[3],
+                        double earthshine, const PixelFormat* pf,
+                        unsigned int* out);
+extern unsigned char* DiscMaskBits(unsigned int diam);
+extern const unsigned char* DarkCoverage(ShadeCache* sc, unsigned int diam,
+                                         const double sun[3]);
+
+#endif /* MOONPIXEL_H */
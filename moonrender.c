@@ -0,0 +1,220 @@
+/*
+ * moonrender.c: darken the moon's dark side on the X server with
+ * the RENDER extension, instead of with the core protocol.
+ *
+ * The dark part of the disc goes up as an 8-bit alpha mask, with
+ * anti-aliased edges, and one Composite request lays translucent
+ * black over the moon through it.  That works the same on any
+ * visual, unlike ANDing with a pixel value.
+ *
+ * An ARGB window can't take the moon pixmap, which has the screen's
+ * depth, with CopyArea either: RENDER copies it in through its shape.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+#include "moonpixel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <X11/extensions/Xrender.h>
+
+/* A context's RENDER resources */
+struct RenderState {
+    int haveRender;
+    XRenderPictFormat* winFormat;
+    XRenderPictFormat* moonFormat;  /* of the moon pixmaps */
+    Picture darkPicture;
+
+    /* Pictures of the moon pixmap and its shape, for CopyMoonRender */
+    Picture moonPicture;
+    Drawable moonPictureSource;
+    Picture shapePicture;
+    Drawable shapePictureSource;
+
+    /* Picture for the drawable being drawn into */
+    Picture targetPicture;
+    Drawable pictureTarget;
+
+    /* The dark-side mask, for the current size */
+    Pixmap maskPixmap;
+    Picture maskPicture;
+    GC maskGC;
+    unsigned int maskDiam;
+};
+
+static struct RenderState* InitRender(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+    struct RenderState* rs;
+    int event_base, error_base;
+    XRenderColor black;
+
+    rs = ctx->render = calloc(1, sizeof *rs);
+    if (!rs)
+        return 0;
+
+    TraceRoundTrip(dpy, "XRenderQueryExtension");
+    rs->haveRender = XRenderQueryExtension(dpy, &event_base, &error_base);
+    if (!rs->haveRender)
+        return rs;
+
+    TraceRoundTrip(dpy, "XRenderQueryFormats");
+    rs->winFormat = XRenderFindVisualFormat(dpy, ctx->visual);
+    rs->moonFormat = XRenderFindVisualFormat(dpy,
+                                             DefaultVisual(dpy, ctx->screen));
+    if (!rs->winFormat || !rs->moonFormat)
+    {
+        rs->haveRender = 0;
+        return rs;
+    }
+
+    /* Premultiplied black, as opaque as the dark side is dark */
+    black.red = black.green = black.blue = 0;
+    black.alpha = (unsigned short)((1. - ctx->earthshine) * 0xffff);
+    rs->darkPicture = XRenderCreateSolidFill(dpy, &black);
+    return rs;
+}
+
+/* (Re)make the A8 mask pixmap for a moon of this size. */
+static int MakeMask(MoonContext* ctx, struct RenderState* rs,
+                    unsigned int diam)
+{
+    Display* dpy = ctx->dpy;
+    XRenderPictFormat* a8;
+
+    if (rs->maskPicture != None && rs->maskDiam == diam)
+        return 0;
+
+    if (rs->maskPicture != None)
+    {
+        XRenderFreePicture(dpy, rs->maskPicture);
+        XFreePixmap(dpy, rs->maskPixmap);
+        rs->maskPicture = None;
+    }
+    a8 = XRenderFindStandardFormat(dpy, PictStandardA8);
+    if (!a8)
+        return -1;
+    rs->maskPixmap = XCreatePixmap(dpy, ctx->win, diam, diam, 8);
+    rs->maskPicture = XRenderCreatePicture(dpy, rs->maskPixmap, a8, 0, 0);
+    if (!rs->maskGC)
+        rs->maskGC = XCreateGC(dpy, rs->maskPixmap, 0, 0);
+    rs->maskDiam = diam;
+    return 0;
+}
+
+/* Keep *picture a picture of pix, in format. */
+static Picture PictureOf(Display* dpy, Picture* picture, Drawable* source,
+                         Drawable pix, XRenderPictFormat* format)
+{
+    if (*source != pix)
+    {
+        if (*picture != None)
+            XRenderFreePicture(dpy, *picture);
+        *picture = XRenderCreatePicture(dpy, pix, format, 0, 0);
+        *source = pix;
+    }
+    return *picture;
+}
+
+/* A picture for drawing into d, which must have the window's visual. */
+static Picture TargetPicture(MoonContext* ctx, struct RenderState* rs,
+                             Drawable d)
+{
+    return PictureOf(ctx->dpy, &rs->targetPicture, &rs->pictureTarget, d,
+                     rs->winFormat);
+}
+
+/* Darken the dark side of a moon already drawn in d, which must have
+ * the window's visual (the window, its back buffer or a pixmap).
+ * Returns 0 on success, -1 if RENDER can't be used.
+ */
+int PaintDarksideRender(MoonContext* ctx, Drawable d, int moonsize,
+                        time_t date)
+{
+    Display* dpy = ctx->dpy;
+    struct RenderState* rs = ctx->render;
+    const unsigned char* dark;
+    double sun[3];
+    XImage* img;
+
+    if (!rs && !(rs = InitRender(ctx)))
+        return -1;
+    if (!rs->haveRender || MakeMask(ctx, rs, moonsize) != 0)
+        return -1;
+    if (!ctx->shade && !(ctx->shade = NewShadeCache()))
+        return -1;
+
+    GetSunDirection(date, sun);
+    dark = DarkCoverage(ctx->shade, moonsize, sun);
+    if (!dark)
+        return -1;
+
+    img = XCreateImage(dpy, DefaultVisual(dpy, ctx->screen), 8, ZPixmap, 0,
+                       (char*)dark, moonsize, moonsize, 8, moonsize);
+    if (!img)
+        return -1;
+    XPutImage(dpy, rs->maskPixmap, rs->maskGC, img,
+              0, 0, 0, 0, moonsize, moonsize);
+    img->data = 0;          /* it's DarkCoverage's buffer */
+    XDestroyImage(img);
+
+    XRenderComposite(dpy, PictOpOver, rs->darkPicture, rs->maskPicture,
+                     TargetPicture(ctx, rs, d), 0, 0, 0, 0, 0, 0,
+                     moonsize, moonsize);
+    return 0;
+}
+
+/* Copy ctx's moon pixmap into d, which must have the window's visual,
+ * through the moon's shape: outside it, d is left transparent.  Then
+ * darken the dark side as PaintDarksideRender does.
+ * Returns 0 on success, -1 if RENDER can't be used.
+ */
+int CopyMoonRender(MoonContext* ctx, Drawable d, int moonsize, time_t date)
+{
+    Display* dpy = ctx->dpy;
+    struct RenderState* rs = ctx->render;
+    XRenderPictFormat* a1;
+
+    if (!rs && !(rs = InitRender(ctx)))
+        return -1;
+    if (!rs->haveRender
+        || !(a1 = XRenderFindStandardFormat(dpy, PictStandardA1)))
+        return -1;
+
+    XRenderComposite(dpy, PictOpSrc,
+                     PictureOf(dpy, &rs->moonPicture, &rs->moonPictureSource,
+                               ctx->moonpix, rs->moonFormat),
+                     PictureOf(dpy, &rs->shapePicture,
+                               &rs->shapePictureSource, ctx->moonmask, a1),
+                     TargetPicture(ctx, rs, d), 0, 0, 0, 0, 0, 0,
+                     moonsize, moonsize);
+    return PaintDarksideRender(ctx, d, moonsize, date);
+}
+
+void FreeRenderState(MoonContext* ctx)
+{
+    struct RenderState* rs = ctx->render;
+
+    if (!rs)
+        return;
+    if (rs->targetPicture != None)
+        XRenderFreePicture(ctx->dpy, rs->targetPicture);
+    if (rs->moonPicture != None)
+        XRenderFreePicture(ctx->dpy, rs->moonPicture);
+    if (rs->shapePicture != None)
+        XRenderFreePicture(ctx->dpy, rs->shapePicture);
+    if (rs->maskPicture != None)
+    {
+        XRenderFreePicture(ctx->dpy, rs->maskPicture);
+        XFreePixmap(ctx->dpy, rs->maskPixmap);
+    }
+    if (rs->maskGC)
+        XFreeGC(ctx->dpy, rs->maskGC);
+    if (rs->darkPicture != None)
+        XRenderFreePicture(ctx->dpy, rs->darkPicture);
+    free(rs);
+    ctx->render = 0;
+}
@@ -5,16 +5,26 @@
  * You are free to use or modify this code under the Gnu Public License.
  */
 
+#define _GNU_SOURCE     /* for pipe2 */
 #include "moonroot.h"
+#include "moonpixel.h"
 
 #include <stdio.h>
 #include <unistd.h>    // for fork
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>    // for getenv
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <libgen.h>    // for basename
 #include <time.h>      // for timezone
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <X11/keysym.h>
-#include <X11/xpm.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/scrnsaver.h>
+#include <X11/extensions/Xdbe.h>
 #include <X11/Xmd.h>   // for CARD32
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
@@ -35,37 +45,258 @@ typedef struct _mwmhints {
     CARD32 status;
 } MotifWmHints;
 
-#include "fullmoon100.xpm"
-#include "fullmoon174.xpm"
-static char** fullmoonXPM = fullmoon174_xpm;
-static unsigned int fullmoonDiam = 174;
+#define DEFAULT_DIAM 174
+#define DEFAULT_EARTHSHINE 0.25
 
-Display* dpy;
-int screen;
-Window win;
+/* Resizing: wait for this long without events before resampling,
+ * so dragging a window corner doesn't resample at every step.
+ */
+#define RESIZE_SETTLE_MS 150
+
+/* Redraw this often, to keep up with the phase */
+static unsigned int updateSecs = 600;
+
+/* Where kill -USR1 writes the stats, if not to stderr */
+static const char* statsPath = 0;
+
+/* -trace-x, and -trace-sync for a synchronous display */
+static int traceX = 0;
+static int traceSync = 0;
+
+/* The control socket, if any: "" means the default for the display */
+static const char* controlPath = 0;
+
+/* -clock, or -at for a fixed one: every window's idea of now */
+static MoonClock moonClock = { CLOCK_REAL, 0, 1., 0. };
+
+/* -o: draw into this file instead of a window, with no display.
+ * -bench repeats that and reports how fast it went.
+ */
+static const char* outputPath = 0;
+static int benchCount = 0;
+static int frameCount = 0;          /* -frames: a time-lapse */
+static long frameStep = 0;          /* seconds between frames */
+static int exportThreads = 0;       /* 0: one per CPU */
+
+/* -compare: check the moon -o would draw against this file, to
+ * within -tolerance per channel, and in -budget microseconds.
+ */
+static const char* comparePath = 0;
+static int tolerance = 1;
+static double drawBudget = 0.;
+
+/* -budget-requests: complain about any frame that takes more */
+static unsigned long requestBudget = 0;
+
+/* -window: -o and -compare take the moon the first window shows */
+static int inWindow = 0;
+
+/* -resize: -o draws the moon at each of these sizes in turn */
+#define MAX_RESIZES 64
+static unsigned int resizeTo[MAX_RESIZES];
+static int numResizes = 0;
+
+/* -animate: a lunation every animateSecs seconds, at animateFps */
+static double animateSecs = 0.;
+static int animateFps = 60;
+
+static int verbose = 0;
+
+/* -frame-sync: wait for the server after each shaded frame, to time
+ * sending it.  That's a round trip a frame, so only when asked.
+ */
+static int frameSync = 0;
+
+/* Each -offset adds a window showing the moon that far from now.
+ * The windows on a display share its connection and event loop,
+ * and every window shares the moon images.
+ */
+#define MAX_WINDOWS 16
+#define WINDOW_GAP 8
+static time_t windowOffsets[MAX_WINDOWS];
+static int numWindows = 0;
+
+/* Each -display adds an X display to serve.  With more than one,
+ * each display's windows run on a thread of their own, with their
+ * own event loop, and the main thread keeps the signals and the
+ * control socket.
+ */
+#define MAX_DISPLAYS 64
+
+typedef struct {
+    const char* name;
+    Display* dpy;
+    MoonContext* windows[MAX_WINDOWS];
+    int updateTimer;
+    int pipeFds[2];         /* messages from the main thread */
+    pthread_t thread;
+    int threaded;
+
+    /* Nothing is drawn on a timer while nobody could see it */
+    int saverEvent;         /* MIT-SCREEN-SAVER's event base, or -1 */
+    int saverOn;
+    int updating;           /* updateTimer is running */
+} MoonDisplay;
+
+static MoonDisplay displays[MAX_DISPLAYS];
+static int numDisplays = 0;
 
-GC gc = 0;
+/* Display threads say here when they finish */
+static int doneFds[2] = { -1, -1 };
+static int threadsRunning = 0;
 
-int XWinSize = 0;
-int YWinSize = 0;
+/* What the main thread asks a display's thread to do */
+#define MSG_REDRAW  0
+#define MSG_TIME    1   /* arg: how far to shift every window */
+#define MSG_SIZE    2   /* arg: the new diameter */
+#define MSG_QUIT    3
 
-static Pixmap moonpix;
-static Pixmap moonmask;
+typedef struct {
+    int what;
+    long arg;
+} DisplayMessage;
 
-int lastMouseX=-1,
-    lastMouseY=-1;
+/* Set by the control socket's "time": the first window's shift */
+static time_t timeShift = 0;
 
-void Quit()
+/* With a compositing manager, -argb gives the window a 32-bit visual
+ * whose alpha channel shapes the moon, instead of a 1-bit shape mask.
+ */
+static int wantARGB = 0;
+
+/* -root draws on the desktop background instead of in a window, at
+ * an X geometry's position: negative from the right or bottom edge.
+ */
+static int onRoot = 0;
+static int rootX = 0, rootY = 0, rootFlags = 0;
+
+/* A context with nothing made yet, and the default settings. */
+static MoonContext* NewContext()
 {
-    XFreePixmap(dpy, moonpix);
+    MoonContext* ctx = calloc(1, sizeof *ctx);
+
+    if (!ctx)
+        return 0;
+    ctx->diam = DEFAULT_DIAM;
+    ctx->renderMode = RENDER_DEFAULT;
+    ctx->earthshine = DEFAULT_EARTHSHINE;
+    ctx->useShm = 1;
+    ctx->clock = &moonClock;
+    ctx->haveShape = -1;
+    ctx->resizeTimer = -1;
+    ctx->lastMouseX = ctx->lastMouseY = -1;
+    return ctx;
+}
+
+/* A new context with proto's settings, for another window. */
+static MoonContext* NewContextLike(const MoonContext* proto)
+{
+    MoonContext* ctx = NewContext();
+
+    if (!ctx)
+        return 0;
+    ctx->diam = proto->diam;
+    ctx->renderMode = proto->renderMode;
+    ctx->earthshine = proto->earthshine;
+    ctx->useShm = proto->useShm;
+    return ctx;
+}
+
+/* Free everything the context made on the server and off it.
+ * The display stays open.
+ */
+static void FreeContext(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+
+    StopAnimation(ctx);
+    FreeDeskState(ctx);
+    if (ctx->shadeImage)
+        DestroyShadeImage(ctx, ctx->shadeImage);
+    FreeShmState(ctx);
+    FreeRenderState(ctx);
+    FreeImageState(ctx);
+    FreeShadeCache(ctx->shade);
+    if (dpy)
+    {
+        if (ctx->moonpix)
+            ReleaseMoonPixmaps(ctx, ctx->moonpix);
+        if (ctx->backPixmap)
+            XFreePixmap(dpy, ctx->backPixmap);
+        if (ctx->backBuffer)
+            XdbeDeallocateBackBufferName(dpy, ctx->backBuffer);
+        if (ctx->aaMask)
+            XFreePixmap(dpy, ctx->aaMask);
+        if (ctx->darksideGC)
+            XFreeGC(dpy, ctx->darksideGC);
+        if (ctx->gc)
+            XFreeGC(dpy, ctx->gc);
+        if (ctx->win && ctx->win != RootWindow(dpy, ctx->screen))
+            XDestroyWindow(dpy, ctx->win);
+    }
+    if (ctx->resizeTimer >= 0)
+    {
+        UnwatchFd(ctx->resizeTimer);
+        close(ctx->resizeTimer);
+    }
+    free(ctx);
+}
+
+void Quit(MoonContext* ctx)
+{
+    FreeContext(ctx);
     exit(0);
 }
 
-void InitWindow(int argc, char** argv)
+/* A window with a depth-32 ARGB visual, if there's one and
+ * a compositing manager to blend it.  Returns 0 if not.
+ */
+static Window CreateARGBWindow(MoonContext* ctx, int x)
 {
+    Display* dpy = ctx->dpy;
+    XVisualInfo vinfo;
+    XSetWindowAttributes attrs;
+    char selname[32];
+    Window w;
+
+    snprintf(selname, sizeof selname, "_NET_WM_CM_S%d", ctx->screen);
+    TraceRoundTrip(dpy, "XInternAtom");
+    TraceRoundTrip(dpy, "XGetSelectionOwner");
+    if (XGetSelectionOwner(dpy, XInternAtom(dpy, selname, False)) == None)
+    {
+        if (verbose)
+            printf("No compositing manager: using a shaped window\n");
+        return 0;
+    }
+    if (!XMatchVisualInfo(dpy, ctx->screen, 32, TrueColor, &vinfo))
+    {
+        if (verbose)
+            printf("No 32-bit visual: using a shaped window\n");
+        return 0;
+    }
+
+    attrs.colormap = XCreateColormap(dpy, RootWindow(dpy, ctx->screen),
+                                     vinfo.visual, AllocNone);
+    attrs.background_pixel = 0;
+    attrs.border_pixel = 0;
+    w = XCreateWindow(dpy, RootWindow(dpy, ctx->screen),
+                      x, 0, ctx->width, ctx->height, 0,
+                      32, InputOutput, vinfo.visual,
+                      CWColormap | CWBackPixel | CWBorderPixel, &attrs);
+    if (w)
+    {
+        ctx->argbWindow = 1;
+        ctx->visual = vinfo.visual;
+        ctx->depth = 32;
+    }
+    return w;
+}
+
+/* Make ctx's own window, at x across the top of the screen. */
+static void CreateMoonWindow(MoonContext* ctx, int x, int argc, char** argv)
+{
+    Display* dpy = ctx->dpy;
     char* appname;
-    XpmAttributes xpmattr;
-    int rv;
     XClassHint classHint;
     XSizeHints size;
 
@@ -73,39 +304,35 @@ void InitWindow(int argc, char** argv)
     Atom property;
     Atom state, skip;
 
-    if ((dpy = XOpenDisplay(getenv("DISPLAY"))) == 0)
-    {
-        fprintf(stderr, "Can't open display: %s\n", getenv("DISPLAY"));
-        exit(1);
-    }
-    screen = DefaultScreen(dpy);
+    if (wantARGB)
+        ctx->win = CreateARGBWindow(ctx, x);
+    if (!ctx->argbWindow)
+        ctx->win = XCreateSimpleWindow(dpy, RootWindow(dpy, ctx->screen),
+                                       x, 0, ctx->width, ctx->height, 3,
+                                       WhitePixel(dpy, ctx->screen),
+                                       BlackPixel(dpy, ctx->screen));
 
-    XWinSize = fullmoonDiam;
-    YWinSize = fullmoonDiam;
-    win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen),
-                              0, 0, XWinSize, YWinSize, 3,
-                              WhitePixel(dpy, screen),
-                              BlackPixel(dpy, screen));
-
-    if (!win)
+    if (!ctx->win)
     {
         fprintf(stderr, "Can't create window\n");
         exit(1);
     }
 
-    size.flags = PMinSize | PMaxSize;
-    size.max_width = 0;
-    size.min_width = XWinSize;
-    size.max_height = 0;
-    size.min_height = YWinSize;
-    XSetWMNormalHints(dpy, win, &size);
+    size.flags = PPosition | PMinSize | PMaxSize;
+    size.x = x;
+    size.y = 0;
+    size.max_width = MAX_MOON_DIAM;
+    size.min_width = MIN_MOON_DIAM;
+    size.max_height = MAX_MOON_DIAM;
+    size.min_height = MIN_MOON_DIAM;
+    XSetWMNormalHints(dpy, ctx->win, &size);
 
     if (argv && argc > 1)
         appname = basename(argv[0]);
     else
         appname = "moonroot";
 
-    XStoreName(dpy, win, appname);
+    XStoreName(dpy, ctx->win, appname);
     /* XStoreName is just a shortcut to XSetWMName */
 
     classHint.res_name = appname;
@@ -113,84 +340,463 @@ void InitWindow(int argc, char** argv)
      * not the same as the XA_NAME prop set by XStoreName.
      */
     classHint.res_class = "MoonRoot";
-    XSetClassHint(dpy, win, &classHint);
+    XSetClassHint(dpy, ctx->win, &classHint);
 
+    TraceRoundTrip(dpy, "XInternAtom");
     state = XInternAtom(dpy, "_NET_WM_STATE", True);
+    TraceRoundTrip(dpy, "XInternAtom");
     skip = XInternAtom(dpy, "_NET_WM_STATE_SKIP_TASKBAR", True);
 
     hints.flags = 2;
     hints.decorations = 0;
 
+    TraceRoundTrip(dpy, "XInternAtom");
     property = XInternAtom(dpy, "_MOTIF_WM_HINTS", True);
 
-    XChangeProperty(dpy, win, property, property, 32,
+    XChangeProperty(dpy, ctx->win, property, property, 32,
                     PropModeReplace, (unsigned char *)&hints, 5);
 
-    XChangeProperty(dpy, win, state, XA_ATOM, 32,
+    XChangeProperty(dpy, ctx->win, state, XA_ATOM, 32,
                     PropModeReplace, (unsigned char*)&skip, 1);
 
+    TraceRoundTrip(dpy, "XInternAtom");
     if (XInternAtom (dpy, "_MOTIF_WM_INFO", True) != None)
     {
         MotifWmHints mwmhints;
-        Atom hints = XInternAtom (dpy, "_MOTIF_WM_HINTS", True);
+        Atom hints;
+
+        TraceRoundTrip(dpy, "XInternAtom");
+        hints = XInternAtom (dpy, "_MOTIF_WM_HINTS", True);
 
         mwmhints.flags = MWM_HINTS_DECORATIONS;
         mwmhints.decorations = 0;
-        XChangeProperty (dpy, win, hints, hints, 32,
+        XChangeProperty (dpy, ctx->win, hints, hints, 32,
                          PropModeReplace,
                          (unsigned char *)&mwmhints, PROP_MWM_HINTS_ELEMENTS);
     }
     /* else window manager doesn't support MWM hints */
 
-    XSelectInput(dpy, win,
+    XSelectInput(dpy, ctx->win,
                  ExposureMask
                  | KeyPressMask
                  | ButtonPressMask | ButtonReleaseMask | Button1MotionMask
-                 | StructureNotifyMask);
+                 | StructureNotifyMask
+                 | VisibilityChangeMask);
+}
+
+/* Draw on the root window instead, x across from the -root position.
+ * Nothing is mapped or shaped: the moon is clipped to its shape.
+ */
+static void UseRootWindow(MoonContext* ctx, int x)
+{
+    Display* dpy = ctx->dpy;
+    int y = rootY;
+
+    if (rootFlags & XNegative)
+        x = DisplayWidth(dpy, ctx->screen) + rootX - (int)ctx->diam - x;
+    else
+        x += rootX;
+    if (rootFlags & YNegative)
+        y = DisplayHeight(dpy, ctx->screen) + rootY - (int)ctx->diam;
+
+    ctx->win = RootWindow(dpy, ctx->screen);
+    ctx->triedDbe = 1;      /* a back buffer would be the whole screen */
+    if (InitDesk(ctx, x, y) != 0)
+    {
+        fprintf(stderr, "Can't draw on the root window\n");
+        exit(1);
+    }
+    if (verbose)
+        printf("Drawing at %d,%d %s\n", x, y,
+               DrawsOnWallpaper(ctx) ? "in the _XROOTPMAP_ID wallpaper"
+                                     : "on the root window");
+}
+
+/* Set ctx up on dpy: its own window at x across the top of the
+ * screen, or with -root, the root window.
+ */
+void InitWindow(MoonContext* ctx, Display* dpy, int x, int argc, char** argv)
+{
+    ctx->dpy = dpy;
+    ctx->screen = DefaultScreen(dpy);
+    TraceBegin(dpy, "init");
+
+    ctx->width = ctx->diam;
+    ctx->height = ctx->diam;
+    ctx->visual = DefaultVisual(dpy, ctx->screen);
+    ctx->depth = DefaultDepth(dpy, ctx->screen);
+    if (onRoot)
+        UseRootWindow(ctx, x);
+    else
+        CreateMoonWindow(ctx, x, argc, argv);
 
     /* Draw the moon bits */
-    xpmattr.valuemask = 0;
-    rv = XpmCreatePixmapFromData(dpy, win, fullmoonXPM,
-                                 &moonpix,
-                                 &moonmask,
-                                 &xpmattr);
-    if (rv != 0)
-        Quit();
+    if (CreateMoonPixmaps(ctx, ctx->diam, 1, &ctx->moonpix, &ctx->moonmask))
+        Quit(ctx);
+
+    /* An ARGB window needs its pixels, alpha and all, from the CPU,
+     * and the exact coverage makes the smoothest alpha.
+     */
+    if (ctx->argbWindow && (ctx->renderMode == RENDER_CORE
+                            || ctx->renderMode == RENDER_XRENDER))
+        fprintf(stderr, "moonroot: -render %s can't draw an ARGB window: "
+                "using aa\n",
+                ctx->renderMode == RENDER_CORE ? "core" : "xrender");
+    if (ctx->argbWindow && ctx->renderMode != RENDER_SHADE)
+        ctx->renderMode = RENDER_AA;
+
+    if (ctx->renderMode != RENDER_CORE && ctx->renderMode != RENDER_XRENDER)
+    {
+        if (ctx->visual->class == TrueColor)
+        {
+            GetPixelFormat(ctx->visual, ctx->depth, &ctx->shadeFormat);
+            if (ctx->renderMode == RENDER_DEFAULT)
+                ctx->renderMode = RENDER_SHADE;
+        }
+        else
+        {
+            if (ctx->renderMode != RENDER_DEFAULT)
+                fprintf(stderr, "Can't shade on this visual\n");
+            ctx->renderMode = RENDER_CORE;
+        }
+    }
 
     XGCValues gcValues;
-    gcValues.foreground = WhitePixel(dpy, screen);
-    gcValues.background = BlackPixel(dpy, screen);
-    gc = XCreateGC(dpy, win, GCForeground | GCBackground, &gcValues);
+    gcValues.foreground = WhitePixel(dpy, ctx->screen);
+    gcValues.background = BlackPixel(dpy, ctx->screen);
+    ctx->gc = XCreateGC(dpy, ctx->win, GCForeground | GCBackground,
+                        &gcValues);
 
-    XMapWindow(dpy, win);
+    if (!onRoot)
+        XMapWindow(dpy, ctx->win);
     XFlush(dpy);            /* Flush just in case */
+    TraceEnd(dpy);
+}
+
+/* Can the window's visual be double-buffered with Xdbe? */
+static int CanDoubleBuffer(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+    int major, minor, nscreens = 1;
+    Window root = RootWindow(dpy, ctx->screen);
+    XdbeScreenVisualInfo* info;
+    VisualID id = XVisualIDFromVisual(ctx->visual);
+    int i, ok = 0;
+
+    TraceRoundTrip(dpy, "XdbeQueryExtension");
+    if (!XdbeQueryExtension(dpy, &major, &minor))
+        return 0;
+    TraceRoundTrip(dpy, "XdbeGetVisualInfo");
+    info = XdbeGetVisualInfo(dpy, &root, &nscreens);
+    if (!info)
+        return 0;
+    for (i = 0; i < info->count; ++i)
+        if (info->visinfo[i].visual == id)
+            ok = 1;
+    XdbeFreeVisualInfo(info);
+    return ok;
+}
+
+/* With an ARGB window, everything outside the moon must be
+ * transparent, so have the server clear the back buffer on a swap.
+ */
+#define SWAP_ACTION (ctx->argbWindow ? XdbeBackground : XdbeUndefined)
+
+/* Where to draw the next frame. */
+static Drawable BackBuffer(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+
+    if (!ctx->triedDbe)
+    {
+        ctx->triedDbe = 1;
+        if (CanDoubleBuffer(ctx))
+            ctx->backBuffer = XdbeAllocateBackBufferName(dpy, ctx->win,
+                                                         SWAP_ACTION);
+        if (verbose)
+            printf("Drawing via %s\n",
+                   ctx->backBuffer != None ? "Xdbe back buffer" : "pixmap");
+    }
+    /* The back buffer is the window's size: in a window that's not
+     * square, the moon is drawn on its own and copied to the middle.
+     */
+    if (ctx->backBuffer != None && !ctx->moonX && !ctx->moonY)
+        return ctx->backBuffer;
+
+    if (ctx->backPixmap == None || ctx->backPixmapDiam != ctx->diam)
+    {
+        if (ctx->backPixmap != None)
+            XFreePixmap(dpy, ctx->backPixmap);
+        ctx->backPixmap = XCreatePixmap(dpy, ctx->win, ctx->diam, ctx->diam,
+                                        ctx->depth);
+        ctx->backPixmapDiam = ctx->diam;
+    }
+    return ctx->backPixmap;
+}
+
+/* Show the frame just drawn in back, from BackBuffer(). */
+static void Present(MoonContext* ctx, Drawable back)
+{
+    Display* dpy = ctx->dpy;
+
+    if (back == ctx->backBuffer)
+    {
+        XdbeSwapInfo swap;
+        swap.swap_window = ctx->win;
+        swap.swap_action = SWAP_ACTION;
+        XdbeSwapBuffers(dpy, &swap, 1);
+    }
+    else
+        XCopyArea(dpy, back, ctx->win, ctx->gc, 0, 0,
+                  ctx->diam, ctx->diam, ctx->moonX, ctx->moonY);
+}
+
+static double Milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Shade the whole moon on the CPU and send it in one request.
+ * Returns 0 on success.
+ */
+static int DrawShaded(MoonContext* ctx, Drawable d, time_t now)
+{
+    Display* dpy = ctx->dpy;
+    const unsigned int* argb = GetMoonARGB(ctx, ctx->diam);
+    double sun[3];
+    double start = 0., shaded = 0.;
+
+    if (!argb)
+        return -1;
+
+    if (ctx->shadeImage && ctx->shadeImage->width != (int)ctx->diam)
+    {
+        DestroyShadeImage(ctx, ctx->shadeImage);
+        ctx->shadeImage = 0;
+    }
+    if (!ctx->shadeImage)
+    {
+        ctx->shadeImage = CreateShadeImage(ctx);
+        if (!ctx->shadeImage)
+            return -1;
+        if (!IsNativeWords(ctx->shadeImage))
+        {
+            /* Not a pixel layout ShadeMoon can write: don't try again */
+            DestroyShadeImage(ctx, ctx->shadeImage);
+            ctx->shadeImage = 0;
+            ctx->renderMode = RENDER_CORE;
+            return -1;
+        }
+        if (verbose)
+            printf("Sending %ux%u images with %s\n",
+                   ctx->diam, ctx->diam,
+                   IsShmImage(ctx, ctx->shadeImage) ? "MIT-SHM" : "XPutImage");
+    }
+
+    if (verbose || frameSync)
+        start = Milliseconds();
+    if (!ctx->shade && !(ctx->shade = NewShadeCache()))
+        return -1;
+    PrepareShadeImage(ctx, ctx->shadeImage);
+    GetSunDirection(now, sun);
+    if (ctx->renderMode == RENDER_AA)
+        ShadeMoonAA(ctx->shade, argb, ctx->diam, sun, ctx->earthshine,
+                    &ctx->shadeFormat, (unsigned int*)ctx->shadeImage->data);
+    else
+        ShadeMoon(ctx->shade, argb, ctx->diam, sun, ctx->earthshine,
+                  &ctx->shadeFormat, (unsigned int*)ctx->shadeImage->data);
+    if (verbose || frameSync)
+        shaded = Milliseconds();
+    PutShadeImage(ctx, d, ctx->shadeImage);
+
+    if (verbose && !frameSync)
+        printf("Frame: shade %.2f ms\n", shaded - start);
+    else if (frameSync)
+    {
+        /* Only a round trip says when the server has the pixels */
+        double sent, bytes;
+        TraceRoundTrip(dpy, "XSync");
+        XSync(dpy, False);
+        sent = Milliseconds();
+        bytes = (double)ctx->shadeImage->bytes_per_line * ctx->diam;
+        printf("Frame %.2f ms: shade %.2f ms, %s %.2f ms (%.0f MB/s)\n",
+               sent - start, shaded - start,
+               IsShmImage(ctx, ctx->shadeImage) ? "shm" : "put", sent - shaded,
+               sent > shaded ? bytes / 1e3 / (sent - shaded) : 0.);
+    }
+    return 0;
+}
+
+/* The window shape for the current render mode. */
+static Pixmap ShapeMask(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+    unsigned char* bits;
+
+    if (ctx->renderMode != RENDER_AA)
+        return ctx->moonmask;
+    if (ctx->aaMask != None && ctx->aaMaskDiam == ctx->diam)
+        return ctx->aaMask;
+
+    bits = DiscMaskBits(ctx->diam);
+    if (!bits)
+        return ctx->moonmask;
+    if (ctx->aaMask != None)
+        XFreePixmap(dpy, ctx->aaMask);
+    ctx->aaMask = XCreateBitmapFromData(dpy, ctx->win, (char*)bits,
+                                        ctx->diam, ctx->diam);
+    ctx->aaMaskDiam = ctx->diam;
+    free(bits);
+    return ctx->aaMask;
 }
 
-void Draw()
+static void DrawFrame(MoonContext* ctx);
+
+/* Draw, keeping count of what it costs.
+ * Returns the number of X requests the frame took.
+ */
+unsigned long Draw(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+    double start = StatsClock();
+    unsigned long firstRequest = NextRequest(dpy);
+    unsigned long requests;
+
+    TraceBegin(dpy, "frame");
+    DrawFrame(ctx);
+    TraceEnd(dpy);
+    requests = NextRequest(dpy) - firstRequest;
+    if (requestBudget && requests > requestBudget)
+        fprintf(stderr, "moonroot: a frame took %lu X requests, "
+                "over the budget of %lu\n", requests, requestBudget);
+    StatsRecord(STAT_DRAW_REQUESTS, requests);
+    StatsRecord(STAT_DRAW_US, StatsClock() - start);
+    return requests;
+}
+
+/* Shape a shaped window to the moon. */
+static void SetShape(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+
+    if (ctx->haveShape < 0)
+    {
+        int shape_event_base, shape_error_base;
+
+        TraceRoundTrip(dpy, "XShapeQueryExtension");
+        ctx->haveShape = XShapeQueryExtension(dpy, &shape_event_base,
+                                              &shape_error_base);
+    }
+    if (ctx->haveShape)
+        XShapeCombineMask(dpy, ctx->win, ShapeBounding,
+                          ctx->moonX, ctx->moonY, ShapeMask(ctx), ShapeSet);
+}
+
+static void DrawFrame(MoonContext* ctx)
 {
-    int shape_event_base, shape_error_base;
+    Display* dpy = ctx->dpy;
+    Drawable back;
     time_t now;
 
-    XCopyArea(dpy, moonpix, win, gc,
-              0, 0,
-              fullmoonDiam, fullmoonDiam,
-              0, 0);
+    /* Animating, the frames come from the ring on the next tick */
+    if (ctx->anim)
+    {
+        if (!ctx->argbWindow)
+            SetShape(ctx);
+        return;
+    }
+    back = BackBuffer(ctx);
 
     /* time() appears to be UTC already,
      * though the man page isn't clear about it.
      */
-    time(&now);
+    now = MoonTime(ctx);
 
-    PaintDarkside(fullmoonDiam, now);
+    if (ctx->argbWindow)
+    {
+        /* The alpha channel is the shape: no mask.  ctx->moonpix
+         * isn't the window's depth, so without shading, RENDER copies
+         * it in.
+         */
+        if (DrawShaded(ctx, back, now) == 0
+            || CopyMoonRender(ctx, back, ctx->diam, now) == 0)
+            Present(ctx, back);
+        return;
+    }
+
+    if (ctx->renderMode == RENDER_CORE || ctx->renderMode == RENDER_XRENDER
+        || DrawShaded(ctx, back, now) != 0)
+    {
+        XCopyArea(dpy, ctx->moonpix, back, ctx->gc,
+                  0, 0,
+                  ctx->diam, ctx->diam,
+                  0, 0);
 
-    if (XShapeQueryExtension(dpy, &shape_event_base, &shape_error_base))
-        XShapeCombineMask(dpy, win, ShapeBounding,
-                          0, 0, moonmask, ShapeSet);
+        if (ctx->renderMode != RENDER_XRENDER
+            || PaintDarksideRender(ctx, back, ctx->diam, now) != 0)
+            PaintDarkside(ctx, back, ctx->diam, now);
+    }
+    if (ctx->desk)
+    {
+        PresentOnDesk(ctx, back, ShapeMask(ctx));
+        return;
+    }
+    Present(ctx, back);
+    SetShape(ctx);
 }
 
-int HandleEvent()
+/* The diameter of the moon that fits the window. */
+static unsigned int FitDiam(const MoonContext* ctx)
 {
-    XEvent event;
+    int diam = ctx->width < ctx->height ? ctx->width : ctx->height;
+
+    if (diam < MIN_MOON_DIAM)
+        return MIN_MOON_DIAM;
+    if (diam > MAX_MOON_DIAM)
+        return MAX_MOON_DIAM;
+    return (unsigned int)diam;
+}
+
+/* Put the moon in the middle of the window. */
+static void CentreMoon(MoonContext* ctx)
+{
+    ctx->moonX = ctx->width > (int)ctx->diam
+                 ? (ctx->width - (int)ctx->diam) / 2 : 0;
+    ctx->moonY = ctx->height > (int)ctx->diam
+                 ? (ctx->height - (int)ctx->diam) / 2 : 0;
+}
+
+/* The window has settled at a new size: make the moon fit it. */
+static void ApplyResize(MoonContext* ctx)
+{
+    unsigned int diam = FitDiam(ctx);
+    Pixmap newpix, newmask;
+
+    if (diam == ctx->diam)
+        return;
+
+    if (CreateMoonPixmaps(ctx, diam, 0, &newpix, &newmask) != 0)
+        return;
+    ReleaseMoonPixmaps(ctx, ctx->moonpix);
+    ctx->moonpix = newpix;
+    ctx->moonmask = newmask;
+    ctx->diam = diam;
+    CentreMoon(ctx);
+
+    if (verbose)
+        printf("Resized to %u: %d resamples so far\n", diam, moonResamples);
+
+    RestartAnimation(ctx, 0);
+    ctx->needDraw = 1;
+}
+
+/* Returns -1 to quit. */
+static int HandleEvent(MoonContext* ctx, XEvent* ev)
+{
+    Display* dpy = ctx->dpy;
+    XEvent event = *ev;
     time_t sec;
     char buffer[20];
     KeySym keysym;
@@ -199,45 +805,80 @@ int HandleEvent()
     Window dummy;
     int curWinX, curWinY;
 
-    XNextEvent(dpy, &event);
     switch (event.type)
     {
         case Expose:
+            if (!ctx->desk || HandleDeskEvent(ctx, &event))
+                ctx->needDraw = 1;
+            break;
+
+        case PropertyNotify:    /* on the root, with -root */
+            if (ctx->desk && HandleDeskEvent(ctx, &event))
+                ctx->needDraw = 1;
+            break;
+
         case MapNotify:
-            Draw();
+            ctx->hidden = 0;
+            ctx->needDraw = 1;
+            break;
+
+        case UnmapNotify:    /* e.g. on another desktop */
+            ctx->hidden = 1;
+            break;
+
+        /* A compositing manager's windows always look unobscured,
+         * so this only helps without one.
+         */
+        case VisibilityNotify:
+            ctx->hidden = event.xvisibility.state == VisibilityFullyObscured;
             break;
 
         case ConfigureNotify:
-            XWinSize = event.xconfigure.width;
-            YWinSize = event.xconfigure.height;
-            //printf("ConfigureNotify: now (%d, %d)\n", XWinSize, YWinSize);
+            ctx->width = event.xconfigure.width;
+            ctx->height = event.xconfigure.height;
+            //printf("ConfigureNotify: now (%d, %d)\n",
+            //       ctx->width, ctx->height);
+            if (FitDiam(ctx) == ctx->diam)
+            {
+                /* Same moon, maybe in a different shape of window */
+                int x = ctx->moonX, y = ctx->moonY;
+
+                CentreMoon(ctx);
+                if (x != ctx->moonX || y != ctx->moonY)
+                    ctx->needDraw = 1;
+                break;
+            }
+            /* Each step of a drag pushes the resize back a bit */
+            if (ctx->resizeTimer >= 0)
+                SetTimer(ctx->resizeTimer, RESIZE_SETTLE_MS, 0);
+            else
+                ApplyResize(ctx);
             break;
 
         case ButtonPress:
-            lastMouseX = event.xbutton.x_root;
-            lastMouseY = event.xbutton.y_root;
+            ctx->lastMouseX = event.xbutton.x_root;
+            ctx->lastMouseY = event.xbutton.y_root;
             break;
 
         case ButtonRelease:
-            lastMouseX = lastMouseY = -1;
+            ctx->lastMouseX = ctx->lastMouseY = -1;
             break;
 
         case MotionNotify:
-            if (lastMouseX > 0) {
+            if (ctx->lastMouseX > 0) {
                 curWinX = event.xmotion.x_root - event.xmotion.x;
                 curWinY = event.xmotion.y_root - event.xmotion.y;
-                XMoveWindow(dpy, win,
-                            curWinX + event.xmotion.x_root - lastMouseX,
-                            curWinY + event.xmotion.y_root - lastMouseY);
+                XMoveWindow(dpy, ctx->win,
+                            curWinX + event.xmotion.x_root - ctx->lastMouseX,
+                            curWinY + event.xmotion.y_root - ctx->lastMouseY);
             }
-            lastMouseX = event.xmotion.x_root;
-            lastMouseY = event.xmotion.y_root;
+            ctx->lastMouseX = event.xmotion.x_root;
+            ctx->lastMouseY = event.xmotion.y_root;
 
             //XFlush(dpy);
             break;
 
         case ReparentNotify: /* When we make the window shaped? */
-        case UnmapNotify:    /* e.g. move to all desktops? */
         case NoExpose:       /* No idea what this is */
         case MappingNotify:  /* not sure why this is called after start */
             break;
@@ -261,21 +902,1149 @@ int HandleEvent()
     return 0;
 }
 
+/* Hand an event to the window it's for: with -root, every moon
+ * shares the root.  Returns -1 to quit.
+ */
+static int DispatchEvent(MoonDisplay* md, XEvent* event)
+{
+    int i;
+
+    StatsCountEvent(event->type);
+    if (md->saverEvent >= 0
+        && event->type == md->saverEvent + ScreenSaverNotify)
+    {
+        md->saverOn = ((XScreenSaverNotifyEvent*)event)->state
+            != ScreenSaverOff;
+        return 0;
+    }
+    for (i = 0; i < numWindows; ++i)
+        if (HandleShmEvent(md->windows[i], event))
+            return 0;
+    for (i = 0; i < numWindows; ++i)
+        if (md->windows[i]->win == event->xany.window
+            && HandleEvent(md->windows[i], event) < 0)
+            return -1;
+    return 0;
+}
+
+static unsigned long UpdateInterval();
+
+/* Timed drawing only while someone could see it: a window that's
+ * covered or unmapped, or every window when the screen saver is on,
+ * stops animating and misses its updates, and the update timer stops
+ * when no window needs it.  Each catches up with one redraw when it
+ * can be seen again.
+ */
+static void UpdateVisibility(MoonDisplay* md)
+{
+    int i, anySeen = 0;
+
+    for (i = 0; i < numWindows; ++i)
+    {
+        MoonContext* ctx = md->windows[i];
+        int seen = !ctx->hidden && !md->saverOn;
+
+        PauseAnimation(ctx, !seen);
+        if (seen && ctx->stale)
+        {
+            ctx->stale = 0;
+            ctx->needDraw = 1;
+        }
+        anySeen |= seen;
+    }
+    if (md->updateTimer < 0 || anySeen == md->updating)
+        return;
+
+    md->updating = anySeen;
+    if (verbose)
+        printf("%s: %s timed updates\n", DisplayString(md->dpy),
+               anySeen ? "resuming" : "nothing to see, pausing");
+    if (anySeen)
+    {
+        unsigned long us = UpdateInterval();
+        SetTimerUs(md->updateTimer, us, us);
+    }
+    else
+    {
+        SetTimerUs(md->updateTimer, 0, 0);
+        for (i = 0; i < numWindows; ++i)
+            md->windows[i]->stale = 1;
+    }
+}
+
+/* Handle every event Xlib has, then draw each window that asked to,
+ * once.
+ */
+static void ProcessX(int fd, void* data)
+{
+    MoonDisplay* md = data;
+    XEvent event;
+    int i;
+
+    while (XPending(md->dpy))
+    {
+        XNextEvent(md->dpy, &event);
+        if (DispatchEvent(md, &event) < 0)
+        {
+            QuitLoop();
+            return;
+        }
+    }
+    UpdateVisibility(md);
+    for (i = 0; i < numWindows; ++i)
+        if (md->windows[i]->needDraw)
+        {
+            md->windows[i]->needDraw = 0;
+            Draw(md->windows[i]);
+        }
+    XFlush(md->dpy);
+}
+
+/* Before sleeping: events can be queued in Xlib (say, read during an
+ * XSync) without the socket being readable, and timers ask for draws.
+ */
+static void PrepareX(int fd, void* data)
+{
+    MoonDisplay* md = data;
+    int i;
+
+    for (i = 0; i < numWindows; ++i)
+        if (md->windows[i]->needDraw)
+            break;
+    if (i < numWindows || QLength(md->dpy) > 0)
+        ProcessX(fd, data);
+    else
+        XFlush(md->dpy);
+}
+
+static void ResizeTimeout(int fd, void* data)
+{
+    ReadTimer(fd);
+    ApplyResize(data);
+}
+
+static void UpdateTimeout(int fd, void* data)
+{
+    MoonDisplay* md = data;
+    int i;
+
+    ReadTimer(fd);
+    for (i = 0; i < numWindows; ++i)
+    {
+        MoonContext* ctx = md->windows[i];
+
+        if (ctx->hidden || md->saverOn)
+            ctx->stale = 1;
+        else
+            ctx->needDraw = 1;
+    }
+}
+
+/* Ask a display's thread to do something.  Messages are smaller than
+ * PIPE_BUF, so each write is whole.
+ */
+static void PostMessage(MoonDisplay* md, int what, long arg)
+{
+    DisplayMessage msg;
+
+    msg.what = what;
+    msg.arg = arg;
+    if (write(md->pipeFds[1], &msg, sizeof msg) != sizeof msg)
+        fprintf(stderr, "moonroot: %s isn't keeping up\n",
+                XDisplayName(md->name));
+}
+
+static void PostAll(int what, long arg)
+{
+    int i;
+
+    for (i = 0; i < numDisplays; ++i)
+        PostMessage(&displays[i], what, arg);
+}
+
+/* On a display's thread: act on what the main thread asked. */
+static void ReadMessages(int fd, void* data)
+{
+    MoonDisplay* md = data;
+    DisplayMessage msg;
+    int i;
+
+    while (read(fd, &msg, sizeof msg) == sizeof msg)
+        for (i = 0; i < numWindows; ++i)
+        {
+            MoonContext* ctx = md->windows[i];
+
+            switch (msg.what)
+            {
+                case MSG_REDRAW:
+                    ctx->needDraw = 1;
+                    break;
+                case MSG_TIME:
+                    ctx->timeOffset = windowOffsets[i] + msg.arg;
+                    RestartAnimation(ctx, 1);
+                    ctx->needDraw = 1;
+                    break;
+                case MSG_SIZE:
+                    /* Arrives back as a ConfigureNotify, like any resize,
+                     * except on the root, which keeps its size.
+                     */
+                    if (ctx->desk)
+                    {
+                        ctx->width = ctx->height = msg.arg;
+                        ApplyResize(ctx);
+                    }
+                    else
+                        XResizeWindow(md->dpy, ctx->win, msg.arg, msg.arg);
+                    break;
+                case MSG_QUIT:
+                    QuitLoop();
+                    break;
+            }
+        }
+}
+
+/* Dump the stats to the -stats file, or to stderr. */
+static void WriteStats()
+{
+    FILE* fp;
+
+    if (!statsPath)
+    {
+        DumpStats(stderr);
+        return;
+    }
+    fp = fopen(statsPath, "w");
+    if (!fp)
+    {
+        perror(statsPath);
+        return;
+    }
+    DumpStats(fp);
+    fclose(fp);
+}
+
+static void HandleSignal(int fd, void* data)
+{
+    struct signalfd_siginfo info;
+
+    while (read(fd, &info, sizeof info) == sizeof info)
+    {
+        if (info.ssi_signo == SIGHUP)
+        {
+            if (verbose)
+                printf("SIGHUP: redrawing\n");
+            PostAll(MSG_REDRAW, 0);
+        }
+        else if (info.ssi_signo == SIGUSR1)
+            WriteStats();
+        else
+            QuitLoop();
+    }
+}
+
+/* Answer a command from the control socket.  Commands act on every
+ * window; times are those of the first window.
+ */
+static void ControlCommand(const char* line, char* reply, size_t len,
+                           void* data)
+{
+    char cmd[32];
+    long arg = 0;
+    int nargs = sscanf(line, "%31s %ld", cmd, &arg);
+    time_t now = ClockNow(&moonClock) + windowOffsets[0] + timeShift;
+
+    if (nargs < 1)
+        snprintf(reply, len, "error empty command");
+    else if (!strcmp(cmd, "ping"))
+        snprintf(reply, len, "ok pong");
+    else if (!strcmp(cmd, "phase"))
+        snprintf(reply, len, "ok phase %.2f illuminated %.3f time %ld",
+                 GetPhaseAngle(now) * 180. / M_PI,
+                 GetIlluminatedFraction(now), (long)now);
+    else if (!strcmp(cmd, "nextfull"))
+        snprintf(reply, len, "ok nextfull %ld", (long)NextFullMoon(now));
+    else if (!strcmp(cmd, "redraw"))
+    {
+        PostAll(MSG_REDRAW, 0);
+        snprintf(reply, len, "ok");
+    }
+    else if (!strcmp(cmd, "size") && nargs == 2)
+    {
+        if (arg < MIN_MOON_DIAM || arg > MAX_MOON_DIAM)
+            snprintf(reply, len, "error size must be %d to %d",
+                     MIN_MOON_DIAM, MAX_MOON_DIAM);
+        else
+        {
+            PostAll(MSG_SIZE, arg);
+            snprintf(reply, len, "ok");
+        }
+    }
+    else if (!strcmp(cmd, "time"))
+    {
+        /* "time T" shows the first moon at unix time T, and the rest
+         * at their -offset from it; "time" alone goes back to now.
+         */
+        timeShift = nargs == 2
+            ? arg - ClockNow(&moonClock) - windowOffsets[0] : 0;
+        PostAll(MSG_TIME, timeShift);
+        snprintf(reply, len, "ok time %ld",
+                 (long)(ClockNow(&moonClock) + windowOffsets[0]
+                        + timeShift));
+    }
+    else if (!strcmp(cmd, "resamples"))
+        snprintf(reply, len, "ok resamples %d",
+                 __atomic_load_n(&moonResamples, __ATOMIC_RELAXED));
+    else if (!strcmp(cmd, "quit"))
+    {
+        QuitLoop();
+        snprintf(reply, len, "ok");
+    }
+    else
+        snprintf(reply, len, "error unknown command %s", cmd);
+}
+
+/* Hear when the screen saver comes on and goes off, if the server
+ * will say.
+ */
+static void WatchScreenSaver(MoonDisplay* md)
+{
+    Window root = DefaultRootWindow(md->dpy);
+    XScreenSaverInfo* info;
+    int errorBase;
+
+    md->saverEvent = -1;
+    TraceRoundTrip(md->dpy, "XScreenSaverQueryExtension");
+    if (!XScreenSaverQueryExtension(md->dpy, &md->saverEvent, &errorBase))
+    {
+        md->saverEvent = -1;
+        return;
+    }
+    XScreenSaverSelectInput(md->dpy, root, ScreenSaverNotifyMask);
+    info = XScreenSaverAllocInfo();
+    TraceRoundTrip(md->dpy, "XScreenSaverQueryInfo");
+    if (info && XScreenSaverQueryInfo(md->dpy, root, info))
+        md->saverOn = info->state == ScreenSaverOn;
+    XFree(info);
+}
+
+/* Open a display and make its windows, with proto's settings. */
+static void OpenDisplay(MoonDisplay* md, const MoonContext* proto,
+                        int argc, char** argv)
+{
+    int i;
+
+    if ((md->dpy = XOpenDisplay(md->name)) == 0)
+    {
+        fprintf(stderr, "Can't open display: %s\n", XDisplayName(md->name));
+        exit(1);
+    }
+    if (pipe2(md->pipeFds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    md->updateTimer = -1;
+    if (traceX)
+        StartTrace(md->dpy, traceSync);
+    WatchScreenSaver(md);
+
+    for (i = 0; i < numWindows; ++i)
+    {
+        MoonContext* ctx = NewContextLike(proto);
+
+        if (!ctx)
+            exit(1);
+        ctx->timeOffset = windowOffsets[i];
+        md->windows[i] = ctx;
+        InitWindow(ctx, md->dpy, i * (proto->diam + WINDOW_GAP),
+                   argc, argv);
+    }
+}
+
+/* Microseconds between timed redraws: updateSecs on the clock, so a
+ * fast clock redraws more often, up to 100 times a second, and a
+ * fixed one never needs to.
+ */
+static unsigned long UpdateInterval()
+{
+    double rate = fabs(ClockRate(&moonClock));
+
+    if (rate == 0.)
+        return 0;
+    if (updateSecs * 1e6 / rate < 10000.)
+        return 10000;
+    return (unsigned long)(updateSecs * 1e6 / rate);
+}
+
+/* Hook a display's windows up to the calling thread's event loop.
+ * Returns 0 on success.
+ */
+static int SetUpDisplay(MoonDisplay* md)
+{
+    int i;
+
+    if (WatchFd(ConnectionNumber(md->dpy), ProcessX, md) != 0
+        || WatchFd(md->pipeFds[0], ReadMessages, md) != 0)
+        return -1;
+    SetPrepareProc(PrepareX, md);
+
+    for (i = 0; i < numWindows; ++i)
+    {
+        MoonContext* ctx = md->windows[i];
+
+        ctx->resizeTimer = CreateTimer(ResizeTimeout, ctx);
+        if (animateSecs > 0. && StartAnimation(ctx, animateSecs,
+                                               animateFps) != 0)
+            fprintf(stderr, "moonroot: can't animate: drawing normally\n");
+    }
+    md->updateTimer = CreateTimer(UpdateTimeout, md);
+    if (md->updateTimer >= 0)
+    {
+        unsigned long us = UpdateInterval();
+        SetTimerUs(md->updateTimer, us, us);
+        md->updating = 1;
+    }
+    return 0;
+}
+
+/* Free the display's windows and close it, from the thread whose
+ * loop it's on.
+ */
+static void CloseDisplay(MoonDisplay* md)
+{
+    int i;
+
+    for (i = 0; i < numWindows; ++i)
+        FreeContext(md->windows[i]);
+    if (md->updateTimer >= 0)
+    {
+        UnwatchFd(md->updateTimer);
+        close(md->updateTimer);
+    }
+    UnwatchFd(md->pipeFds[0]);
+    UnwatchFd(ConnectionNumber(md->dpy));
+    XCloseDisplay(md->dpy);
+    md->dpy = 0;
+}
+
+static void* DisplayThread(void* data)
+{
+    MoonDisplay* md = data;
+    char done = 1;
+
+    if (SetUpDisplay(md) == 0)
+        RunLoop();
+    else
+        fprintf(stderr, "moonroot: can't set up the event loop for %s\n",
+                DisplayString(md->dpy));
+    CloseDisplay(md);
+    CloseLoop();
+    if (write(doneFds[1], &done, 1) != 1)
+        perror("moonroot");
+    return 0;
+}
+
+/* On the main thread: once every display's thread is done
+ * (say, q in each), there's nothing left to do.
+ */
+static void ThreadDone(int fd, void* data)
+{
+    char done;
+
+    while (read(fd, &done, 1) == 1)
+        if (--threadsRunning == 0)
+            QuitLoop();
+}
+
+/* Start a thread for each display.  Returns 0 if any started. */
+static int StartDisplayThreads()
+{
+    int i;
+
+    if (pipe2(doneFds, O_NONBLOCK | O_CLOEXEC) != 0
+        || WatchFd(doneFds[0], ThreadDone, 0) != 0)
+        return -1;
+    for (i = 0; i < numDisplays; ++i)
+    {
+        MoonDisplay* md = &displays[i];
+
+        if (pthread_create(&md->thread, 0, DisplayThread, md) != 0)
+        {
+            fprintf(stderr, "moonroot: no thread for %s\n",
+                    DisplayString(md->dpy));
+            continue;
+        }
+        md->threaded = 1;
+        ++threadsRunning;
+    }
+    return threadsRunning > 0 ? 0 : -1;
+}
+
+/* Signals and the control socket, on the main thread's loop. */
+static void SetUpControl()
+{
+    static const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1, 0 };
+
+    if (WatchSignals(signals, HandleSignal, 0) < 0)
+        perror("signalfd");
+
+    if (controlPath)
+    {
+        char path[108];
+
+        if (*controlPath)
+            snprintf(path, sizeof path, "%s", controlPath);
+        else
+            DefaultControlPath(DisplayString(displays[0].dpy),
+                               path, sizeof path);
+        if (StartControl(path, ControlCommand, 0) != 0)
+            fprintf(stderr, "moonroot: can't listen on %s\n", path);
+        else if (verbose)
+            printf("Listening on %s\n", path);
+    }
+}
+
+/* Scale the bits of pixel under mask to 0..255. */
+static unsigned int Channel(unsigned long pixel, unsigned long mask)
+{
+    int bits = 0;
+
+    if (!mask)
+        return 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        pixel >>= 1;
+    }
+    pixel &= mask;
+    for ( ; mask >> bits; ++bits)
+        ;
+    if (bits >= 8)
+        return pixel >> (bits - 8);
+    return pixel * 255 / ((1ul << bits) - 1);
+}
+
+/* Read back what ctx's window shows: opaque pixels inside its
+ * shape, 0 outside.  Returns 0 on success.
+ */
+static int ReadWindow(MoonContext* ctx, unsigned int* argb)
+{
+    Display* dpy = ctx->dpy;
+    Visual* v = ctx->visual;
+    unsigned int x, y, diam = ctx->diam;
+    XImage* image;
+    XImage* shape = 0;
+
+    if (v->class != TrueColor && v->class != DirectColor)
+    {
+        fprintf(stderr, "moonroot: can't read back this visual\n");
+        return -1;
+    }
+    image = XGetImage(dpy, ctx->win, ctx->moonX, ctx->moonY, diam, diam,
+                      AllPlanes, ZPixmap);
+    if (image && ctx->haveShape > 0)
+        shape = XGetImage(dpy, ShapeMask(ctx), 0, 0, diam, diam,
+                          1, XYPixmap);
+    if (!image || (ctx->haveShape > 0 && !shape))
+    {
+        fprintf(stderr, "moonroot: can't read back the window\n");
+        if (image)
+            XDestroyImage(image);
+        return -1;
+    }
+    for (y = 0; y < diam; ++y)
+        for (x = 0; x < diam; ++x)
+        {
+            unsigned long p = XGetPixel(image, x, y);
+
+            if (shape && !XGetPixel(shape, x, y))
+                argb[y*diam + x] = 0;
+            else
+                argb[y*diam + x] = 0xff000000
+                                   | Channel(p, v->red_mask) << 16
+                                   | Channel(p, v->green_mask) << 8
+                                   | Channel(p, v->blue_mask);
+        }
+    XDestroyImage(image);
+    if (shape)
+        XDestroyImage(shape);
+    return 0;
+}
+
+/* -window: show the first window's moon on the display, the way
+ * moonroot always does, then draw it n more times.  Leaves what the
+ * window shows in argb, how long a frame took on average, to the
+ * server and back, in *drawn, and the most X requests any frame
+ * took in *requests.  Returns 0 on success.
+ */
+static int DrawInWindow(MoonContext* ctx, int n, int argc, char** argv,
+                        unsigned int* argb, double* drawn,
+                        unsigned long* requests)
+{
+    Display* dpy = XOpenDisplay(displays[0].name);
+    XEvent event;
+    double start;
+    int i;
+
+    if (!dpy)
+    {
+        fprintf(stderr, "Can't open display: %s\n",
+                XDisplayName(displays[0].name));
+        return -1;
+    }
+    ctx->timeOffset = windowOffsets[0];
+    InitWindow(ctx, dpy, 0, argc, argv);
+    XWindowEvent(dpy, ctx->win, ExposureMask, &event);
+
+    /* The first frame makes the images and asks about extensions */
+    Draw(ctx);
+    XSync(dpy, False);
+    *requests = 0;
+    start = StatsClock();
+    for (i = 0; i < n; ++i)
+    {
+        unsigned long r = Draw(ctx);
+
+        XSync(dpy, False);
+        if (r > *requests)
+            *requests = r;
+    }
+    *drawn = (StatsClock() - start) / n;
+    return ReadWindow(ctx, argb);
+}
+
+/* Free ctx, and its display if it has one. */
+static void FreeWindow(MoonContext* ctx)
+{
+    Display* dpy = ctx->dpy;
+
+    FreeContext(ctx);
+    if (dpy)
+        XCloseDisplay(dpy);
+}
+
+/* -o: draw the first window's moon into a file, no display needed.
+ * Returns the exit status.
+ */
+static int RenderToFile(MoonContext* ctx, int argc, char** argv)
+{
+    time_t date = ClockNow(&moonClock) + windowOffsets[0];
+    unsigned int* pixels = malloc(ctx->diam * ctx->diam * sizeof *pixels);
+    double start, rendered = 0., written = 0.;
+    int i, n = benchCount ? benchCount : 1;
+
+    if (!pixels)
+        return 1;
+    if (inWindow)
+    {
+        unsigned long requests;
+
+        if (DrawInWindow(ctx, n, argc, argv, pixels, &rendered,
+                         &requests) != 0
+            || WriteMoonImage(outputPath, pixels, ctx->diam) != 0)
+        {
+            fprintf(stderr, "moonroot: can't write %s\n", outputPath);
+            return 1;
+        }
+        if (benchCount)
+            fprintf(stderr, "%d frames of %u pixels in a window: "
+                    "%.3f ms and %lu X requests at most each\n",
+                    n, ctx->diam, rendered / 1e3, requests);
+        free(pixels);
+        FreeWindow(ctx);
+        return 0;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        start = StatsClock();
+        if (RenderMoonImage(ctx, date, pixels) != 0)
+        {
+            fprintf(stderr, "moonroot: can't draw the moon\n");
+            return 1;
+        }
+        rendered += StatsClock() - start;
+        start = StatsClock();
+        if (WriteMoonImage(outputPath, pixels, ctx->diam) != 0)
+        {
+            perror(outputPath);
+            return 1;
+        }
+        written += StatsClock() - start;
+    }
+    if (benchCount)
+        fprintf(stderr, "%d images of %u pixels: %.1f images/s "
+                "(draw %.3f ms, write %.3f ms each)\n",
+                n, ctx->diam, n * 1e6 / (rendered + written),
+                rendered / 1e3 / n, written / 1e3 / n);
+    free(pixels);
+    FreeContext(ctx);
+    return 0;
+}
+
+/* -resize: draw the first window's moon, then again at each size as
+ * a window resized to it would, and say how many times that took
+ * resampling the moon.  The last goes to the -o file.
+ * Returns the exit status.
+ */
+static int RenderResizes(MoonContext* ctx)
+{
+    time_t date = ClockNow(&moonClock) + windowOffsets[0];
+    unsigned int* pixels = 0;
+    int before = 0, i;
+
+    for (i = -1; i < numResizes; ++i)
+    {
+        unsigned int* p;
+
+        if (i >= 0)
+            ctx->diam = resizeTo[i];
+        p = realloc(pixels, ctx->diam * ctx->diam * sizeof *pixels);
+        if (!p || RenderMoonImage(ctx, date, p) != 0)
+        {
+            fprintf(stderr, "moonroot: can't draw the moon\n");
+            free(p ? p : pixels);
+            return 1;
+        }
+        pixels = p;
+        if (i < 0)
+            before = __atomic_load_n(&moonResamples, __ATOMIC_RELAXED);
+    }
+    fprintf(stderr, "%d resizes: %d resamples\n", numResizes,
+            __atomic_load_n(&moonResamples, __ATOMIC_RELAXED) - before);
+    if (WriteMoonImage(outputPath, pixels, ctx->diam) != 0)
+    {
+        perror(outputPath);
+        return 1;
+    }
+    free(pixels);
+    FreeContext(ctx);
+    return 0;
+}
+
+/* -compare: draw the first window's moon as -o would, and check it
+ * against a stored one and, with -budget, how long drawing took.
+ * With -window, it's drawn in the window, and -budget-requests
+ * bounds the X requests of every frame.
+ * Returns the exit status: 0 if it passes.
+ */
+static int CompareToGolden(MoonContext* ctx, int argc, char** argv)
+{
+    time_t date = ClockNow(&moonClock) + windowOffsets[0];
+    unsigned int* pixels = malloc(ctx->diam * ctx->diam * sizeof *pixels);
+    double start, drawn;
+    unsigned long requests = 0;
+    int i, n = benchCount ? benchCount : 1, failed = 0, rv;
+    ImageDiff diff;
+
+    if (!pixels)
+        return 1;
+    if (inWindow)
+    {
+        if (DrawInWindow(ctx, n, argc, argv, pixels, &drawn,
+                         &requests) != 0)
+            return 1;
+        rv = CompareShownImage(comparePath, pixels, ctx->diam, tolerance,
+                               &diff);
+    }
+    else
+    {
+        /* The first draw decodes and resamples the moon: leave it out */
+        if (RenderMoonImage(ctx, date, pixels) != 0)
+        {
+            fprintf(stderr, "moonroot: can't draw the moon\n");
+            return 1;
+        }
+        start = StatsClock();
+        for (i = 0; i < n; ++i)
+            RenderMoonImage(ctx, date, pixels);
+        drawn = (StatsClock() - start) / n;
+        rv = CompareMoonImage(comparePath, pixels, ctx->diam, tolerance,
+                              &diff);
+    }
+    if (rv != 0)
+    {
+        fprintf(stderr, "moonroot: can't read %s as a %u-pixel moon\n",
+                comparePath, ctx->diam);
+        return 1;
+    }
+    printf("%s: %lu of %lu pixels off by more than %d (worst %d)",
+           comparePath, diff.differing, diff.pixels, tolerance,
+           diff.maxDiff);
+    failed = diff.differing > 0;
+    printf(", draw %.3f ms", drawn / 1e3);
+    if (drawBudget > 0.)
+    {
+        printf(" of %.3f ms allowed", drawBudget / 1e3);
+        if (drawn > drawBudget)
+            failed = 1;
+    }
+    if (inWindow)
+    {
+        printf(", %lu X requests", requests);
+        if (requestBudget)
+        {
+            printf(" of %lu allowed", requestBudget);
+            if (requests > requestBudget)
+                failed = 1;
+        }
+    }
+    printf(": %s\n", failed ? "FAIL" : "ok");
+    free(pixels);
+    FreeWindow(ctx);
+    return failed;
+}
+
+static int ExportAnimation(MoonContext* ctx)
+{
+    time_t start = ClockNow(&moonClock) + windowOffsets[0];
+    long step = frameStep ? frameStep : LUNATION / frameCount;
+    int threads = exportThreads;
+    double begin, elapsed, waited;
+    int rv;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if (threads > frameCount)
+        threads = frameCount;
+
+    begin = StatsClock();
+    rv = ExportFrames(ctx, outputPath, start, step, frameCount, threads,
+                      &waited);
+    elapsed = StatsClock() - begin;
+    if (rv == 0 && (verbose || benchCount))
+        fprintf(stderr, "%d frames of %u pixels, %ld s apart, on %d "
+                "threads: %.1f frames/s, writer idle %.0f%%\n",
+                frameCount, ctx->diam, step, threads,
+                frameCount * 1e6 / elapsed, 100. * waited / elapsed);
+    FreeContext(ctx);
+    return rv == 0 ? 0 : 1;
+}
+
 static void Usage()
 {
     printf("MoonRoot version 0.7, by Akkana.\n\n");
-    printf("Usage: moonroot [-s]\n");
-    printf("\n-s gives a smaller moon.\n");
+    printf("Usage: moonroot [-display name]... [-s] [-size diameter]\n");
+    printf("                [-render core|shade|aa|xrender]\n");
+    printf("                [-earthshine brightness] [-argb] [-noshm]\n");
+    printf("                [-offset hours]... [-update seconds]\n");
+    printf("                [-animate seconds [-fps rate]]\n");
+    printf("                [-root [+X+Y]]\n");
+    printf("                [-clock spec | -at unixtime]\n");
+    printf("                [-control [socket]] [-budget-requests n]\n");
+    printf("                [-stats file] [-trace-x] [-trace-sync] [-v]\n");
+    printf("                [-frame-sync]\n");
+    printf("       moonroot -o file [-clock spec | -at unixtime]\n");
+    printf("                [-bench count] [-window [-display name]]\n");
+    printf("                [-resize size,size...]\n");
+    printf("                [-frames count [-step seconds] [-threads n]]\n");
+    printf("       moonroot -compare file [-tolerance n] [-budget us]\n");
+    printf("                [-clock spec | -at unixtime] [-bench count]\n");
+    printf("                [-s] [-size diameter] [-render shade|aa]\n");
+    printf("                [-earthshine brightness] [-offset hours]\n");
+    printf("                [-window [-display name] [-render mode]\n");
+    printf("                 [-budget-requests n]]\n");
+    printf("\n-display serves that X display instead of $DISPLAY: give it\n");
+    printf("    more than once to serve up to %d from one process,\n",
+           MAX_DISPLAYS);
+    printf("    each on a thread of its own.\n");
+    printf("-s gives a smaller moon.\n");
+    printf("-size gives a moon of any diameter, in pixels.\n");
+    printf("-render chooses how the dark side is drawn: core darkens\n");
+    printf("    it on the X server, shade lights each pixel (the default\n");
+    printf("    on TrueColor displays), aa shades with exactly\n");
+    printf("    anti-aliased terminator and limb, xrender blends an\n");
+    printf("    anti-aliased dark side on the X server.\n");
+    printf("-earthshine sets how bright the dark side is, except with\n");
+    printf("    -render core: from 0 to 1 (default %.2f).\n",
+           DEFAULT_EARTHSHINE);
+    printf("-argb uses a translucent window for smooth edges,\n");
+    printf("    if there's a compositing manager.  It's shaded on the\n");
+    printf("    CPU: -render core or xrender is taken as aa.\n");
+    printf("-noshm sends shaded moons over the X connection even when\n");
+    printf("    shared memory would work.\n");
+    printf("-offset shows the moon that many hours from now, in a\n");
+    printf("    window of its own: give it more than once for up to %d\n",
+           MAX_WINDOWS);
+    printf("    windows, sharing one connection and one copy of the moon.\n");
+    printf("-update redraws every so many seconds (default %u).\n",
+           updateSecs);
+    printf("-clock sets what time it is: real (the default), fixed:T\n");
+    printf("    for always unix time T, offset:S for S seconds from\n");
+    printf("    now, or scaled:R[:T] for R seconds a second from T\n");
+    printf("    (default now).  -update counts the clock's seconds.\n");
+    printf("-at T is short for -clock fixed:T.\n");
+    printf("-animate plays a whole lunation every so many seconds,\n");
+    printf("    at -fps frames a second (default %d), and reports\n",
+           animateFps);
+    printf("    dropped frames and jitter when the window goes.\n");
+    printf("-root draws on the desktop background instead of in a\n");
+    printf("    window, with the moon's corner at X,Y (default +0+0;\n");
+    printf("    -X or -Y measures from the right or bottom): in the\n");
+    printf("    _XROOTPMAP_ID wallpaper if there is one.  Updates touch\n");
+    printf("    only the moon's square.  Not with -animate or -argb.\n");
+    printf("-control accepts commands from moonctl on a Unix socket,\n");
+    printf("    by default in $XDG_RUNTIME_DIR (else a private\n");
+    printf("    /tmp/moonroot-UID) named after the display.  Only the\n");
+    printf("    user can connect.\n");
+    printf("-stats names the file kill -USR1 writes statistics to,\n");
+    printf("    instead of stderr.\n");
+    printf("-trace-x logs the X requests, round trips and bytes of\n");
+    printf("    each frame; the round trips are only those of the calls\n");
+    printf("    moonroot marks as waiting for a reply.  -trace-sync also\n");
+    printf("    makes every request wait for the server, to time the\n");
+    printf("    real latency.\n");
+    printf("-v prints what moonroot is doing, and how long each frame takes.\n");
+    printf("-frame-sync waits for the server after each shaded frame,\n");
+    printf("    and prints how long shading and sending it took, and\n");
+    printf("    how fast it went: a round trip a frame, so it slows\n");
+    printf("    what it measures a little.\n");
+    printf("-o writes the moon to a file instead of showing it, with no\n");
+    printf("    X server: PPM if the name ends in .ppm, else PNG;\n");
+    printf("    - is stdout.  -clock or -at gives the time to show.\n");
+    printf("-resize draws the moon at each of those sizes in turn,\n");
+    printf("    as a window resized to each would, says how many\n");
+    printf("    times the moon had to be resampled, and writes the\n");
+    printf("    last.\n");
+    printf("-bench draws and writes the file that many times, and\n");
+    printf("    reports images per second.\n");
+    printf("-frames writes a time-lapse of that many frames from then,\n");
+    printf("    -step seconds apart (default: one lunation in all), to\n");
+    printf("    files named by -o with %%d for the frame number, as in\n");
+    printf("    moon%%04d.png, or all to stdout as PPM with -o -.\n");
+    printf("    -threads draws that many at once (default: one per\n");
+    printf("    CPU).\n");
+    printf("-compare draws the moon as -o would, and exits 1 if any\n");
+    printf("    pixel differs from the file's by more than -tolerance\n");
+    printf("    (default %d) in any channel, or if drawing takes more\n",
+           tolerance);
+    printf("    than -budget microseconds (averaged over -bench runs).\n");
+    printf("-budget-requests complains on stderr about any frame that\n");
+    printf("    takes more X requests than that; with -compare\n");
+    printf("    -window, it fails.\n");
+    printf("-window makes -o and -compare draw the moon in a window on\n");
+    printf("    the display, in any -render mode, and take what it\n");
+    printf("    shows: -budget then counts the trip to the server.\n");
     exit(0);
 }
 
 int main(int argc, char** argv)
 {
+    MoonContext* ctx;
+    int i;
+
+    StartStats();
+    ctx = NewContext();
+    if (!ctx)
+        return 1;
     while (argc > 1) {
+        if (!strcmp(argv[1], "-display") && argc > 2) {
+            if (numDisplays >= MAX_DISPLAYS)
+                Usage();
+            displays[numDisplays++].name = argv[2];
+            --argc;
+            ++argv;
+        }
         /* Smaller image */
-        if (argv[1][0] == '-' && argv[1][1] == 's') {
-            fullmoonXPM = fullmoon100_xpm;
-            fullmoonDiam = 100;
+        else if (!strcmp(argv[1], "-s")) {
+            ctx->diam = 100;
+        }
+        /* Any size, resampled */
+        else if (!strcmp(argv[1], "-size") && argc > 2) {
+            int diam = atoi(argv[2]);
+            if (diam < MIN_MOON_DIAM || diam > MAX_MOON_DIAM)
+                Usage();
+            ctx->diam = diam;
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-render") && argc > 2) {
+            if (!strcmp(argv[2], "core"))
+                ctx->renderMode = RENDER_CORE;
+            else if (!strcmp(argv[2], "shade"))
+                ctx->renderMode = RENDER_SHADE;
+            else if (!strcmp(argv[2], "aa"))
+                ctx->renderMode = RENDER_AA;
+            else if (!strcmp(argv[2], "xrender"))
+                ctx->renderMode = RENDER_XRENDER;
+            else
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-earthshine") && argc > 2) {
+            ctx->earthshine = atof(argv[2]);
+            if (ctx->earthshine < 0. || ctx->earthshine > 1.)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-offset") && argc > 2) {
+            double hours = atof(argv[2]);
+            if (numWindows >= MAX_WINDOWS || hours < -1e6 || hours > 1e6)
+                Usage();
+            windowOffsets[numWindows++] = (time_t)(hours * 3600.);
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-argb")) {
+            wantARGB = 1;
+        }
+        else if (!strcmp(argv[1], "-root")) {
+            onRoot = 1;
+            if (argc > 2 && (argv[2][0] == '+'
+                             || (argv[2][0] == '-' && isdigit(argv[2][1]))))
+            {
+                unsigned int w, h;
+
+                rootFlags = XParseGeometry(argv[2], &rootX, &rootY, &w, &h);
+                if (!(rootFlags & XValue) || !(rootFlags & YValue))
+                    Usage();
+                --argc;
+                ++argv;
+            }
+        }
+        else if (!strcmp(argv[1], "-update") && argc > 2) {
+            int secs = atoi(argv[2]);
+            if (secs < 1)
+                Usage();
+            updateSecs = secs;
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-control")) {
+            controlPath = "";
+            if (argc > 2 && argv[2][0] != '-') {
+                controlPath = argv[2];
+                --argc;
+                ++argv;
+            }
+        }
+        else if (!strcmp(argv[1], "-stats") && argc > 2) {
+            statsPath = argv[2];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-trace-x")
+                 || !strcmp(argv[1], "--trace-x")) {
+            traceX = 1;
+        }
+        else if (!strcmp(argv[1], "-trace-sync")) {
+            traceX = traceSync = 1;
+        }
+        else if (!strcmp(argv[1], "-noshm")) {
+            ctx->useShm = 0;
+        }
+        else if (!strcmp(argv[1], "-v")) {
+            verbose = 1;
+        }
+        else if (!strcmp(argv[1], "-frame-sync")) {
+            frameSync = 1;
+        }
+        else if (!strcmp(argv[1], "-o") && argc > 2) {
+            outputPath = argv[2];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-clock") && argc > 2) {
+            if (ParseClock(argv[2], &moonClock) != 0)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-at") && argc > 2) {
+            moonClock.mode = CLOCK_FIXED;
+            moonClock.base = (time_t)atol(argv[2]);
+            moonClock.rate = 0.;
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-bench") && argc > 2) {
+            benchCount = atoi(argv[2]);
+            if (benchCount < 1)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-animate") && argc > 2) {
+            animateSecs = atof(argv[2]);
+            if (animateSecs <= 0.)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-fps") && argc > 2) {
+            animateFps = atoi(argv[2]);
+            if (animateFps < 1 || animateFps > 1000)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-compare") && argc > 2) {
+            comparePath = argv[2];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-tolerance") && argc > 2) {
+            tolerance = atoi(argv[2]);
+            if (tolerance < 0)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-budget") && argc > 2) {
+            drawBudget = atof(argv[2]);
+            if (drawBudget <= 0.)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-resize") && argc > 2) {
+            char* list = argv[2];
+
+            numResizes = 0;
+            while (*list && numResizes < MAX_RESIZES)
+            {
+                long diam = strtol(list, &list, 10);
+                if (diam < MIN_MOON_DIAM || diam > MAX_MOON_DIAM
+                    || (*list && *list++ != ','))
+                    Usage();
+                resizeTo[numResizes++] = diam;
+            }
+            if (*list || !numResizes)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-window")) {
+            inWindow = 1;
+        }
+        else if (!strcmp(argv[1], "-budget-requests") && argc > 2) {
+            requestBudget = strtoul(argv[2], 0, 10);
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-frames") && argc > 2) {
+            frameCount = atoi(argv[2]);
+            if (frameCount < 1)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-step") && argc > 2) {
+            frameStep = atol(argv[2]);
+            if (frameStep == 0)
+                Usage();
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-threads") && argc > 2) {
+            exportThreads = atoi(argv[2]);
+            if (exportThreads < 1)
+                Usage();
+            --argc;
+            ++argv;
         }
         else {
             Usage();
@@ -284,15 +2053,66 @@ int main(int argc, char** argv)
         ++argv;
     }
 
-    InitWindow(argc, argv);
+    /* Every window has the settings given; each has its own offset */
+    if (numWindows == 0)
+        numWindows = 1;
+    if (inWindow && (onRoot || frameCount || numResizes
+                     || (!comparePath && !outputPath)))
+        Usage();
+    if (numResizes && (!outputPath || frameCount || comparePath))
+        Usage();
+    if (comparePath)
+        return CompareToGolden(ctx, argc, argv);
+    if (outputPath && frameCount)
+        return ExportAnimation(ctx);
+    if (outputPath && numResizes)
+        return RenderResizes(ctx);
+    if (outputPath)
+        return RenderToFile(ctx, argc, argv);
+    if (onRoot && animateSecs > 0.)
+    {
+        fprintf(stderr, "moonroot: -animate needs a window of its own: "
+                "not animating on the root\n");
+        animateSecs = 0.;
+    }
+    if (numDisplays == 0)
+        displays[numDisplays++].name = 0;
+    /* Display threads, and animation producers, share connections */
+    if ((numDisplays > 1 || animateSecs > 0.) && !XInitThreads())
+    {
+        fprintf(stderr, "moonroot: this Xlib can't be used from "
+                "several threads\n");
+        return 1;
+    }
+    for (i = 0; i < numDisplays; ++i)
+        OpenDisplay(&displays[i], ctx, argc, argv);
 
     /* run in the background */
     if (fork() > 0)
         return 0;
 
-    while (HandleEvent() >= 0)
-        ;
+    /* Before any threads, so they all start with the signals blocked */
+    SetUpControl();
+    if (numDisplays == 1 ? SetUpDisplay(&displays[0])
+                         : StartDisplayThreads())
+    {
+        fprintf(stderr, "moonroot: can't set up the event loop\n");
+        return 1;
+    }
+    RunLoop();
+    StopControl();
+
+    for (i = 0; i < numDisplays; ++i)
+        if (displays[i].threaded)
+        {
+            PostMessage(&displays[i], MSG_QUIT, 0);
+            pthread_join(displays[i].thread, 0);
+        }
+    if (numDisplays == 1)
+        CloseDisplay(&displays[0]);
+    if (statsPath)
+        WriteStats();
 
-    XFreePixmap(dpy, moonpix);
+    FreeContext(ctx);
     return 0;
 }
@@ -5,15 +5,216 @@
  * You are free to use or modify this code under the Gnu Public License.
  */
 
+#ifndef MOONROOT_H
+#define MOONROOT_H
+
+#include <stdio.h>
+#include <time.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/Xdbe.h>
+
+#include "moonpixel.h"
+
+/* How to draw the dark side */
+#define RENDER_DEFAULT -1   /* shade if the visual allows, else core */
+#define RENDER_CORE     0   /* GXand rows of the window, PaintDarkside */
+#define RENDER_SHADE    1   /* per-pixel shading on the CPU, ShadeMoon */
+#define RENDER_AA       2   /* exact anti-aliased edges, ShadeMoonAA */
+#define RENDER_XRENDER  3   /* server-side alpha blend, PaintDarksideRender */
+
+/* Limits for resampled moons */
+#define MIN_MOON_DIAM 16
+#define MAX_MOON_DIAM 8192
+
+/* A synodic month, new moon to new moon, in seconds */
+#define LUNATION 2551443L
+
+/* Where "now" comes from: see moonclock.c */
+#define CLOCK_REAL      0   /* the system clock */
+#define CLOCK_FIXED     1   /* always base */
+#define CLOCK_OFFSET    2   /* the system clock plus base seconds */
+#define CLOCK_SCALED    3   /* from base, rate times as fast as real time */
+
+typedef struct MoonClock {
+    int mode;
+    time_t base;
+    double rate;            /* clock seconds per real second */
+    double start;           /* StatsClock when a scaled clock was at base */
+} MoonClock;
+
+/* Everything one moon window owns: its display and window, the
+ * resources it draws with, and each module's state for it.
+ * The moon pixmaps and CPU image are shared with other windows
+ * showing the same size; the rest belongs to this window alone.
+ */
+typedef struct MoonContext {
+    Display* dpy;
+    int screen;
+    Window win;
+    GC gc;
+    Visual* visual;
+    int depth;
+    int argbWindow;         /* 32-bit visual, shaped by its alpha */
+
+    int width, height;      /* of the window, from ConfigureNotify */
+    unsigned int diam;      /* of the moon */
+    int moonX, moonY;       /* its top left in the window: centred */
+    Pixmap moonpix;         /* from CreateMoonPixmaps: shared */
+    Pixmap moonmask;
+
+    /* How to draw */
+    int renderMode;
+    double earthshine;      /* dark side brightness, 0 to 1 */
+    int useShm;
+    const MoonClock* clock; /* what "now" is; 0 for the system clock */
+    time_t timeOffset;      /* show the moon this long from now */
+
+    /* Each frame is drawn off screen, then shown in one step: in an
+     * Xdbe back buffer if the server has DOUBLE-BUFFER, else a pixmap.
+     */
+    int triedDbe;
+    XdbeBackBuffer backBuffer;
+    Pixmap backPixmap;
+    unsigned int backPixmapDiam;
+
+    /* Shape for RENDER_AA: every pixel the disc touches */
+    Pixmap aaMask;
+    unsigned int aaMaskDiam;
+    int haveShape;
+
+    /* CPU shading */
+    XImage* shadeImage;
+    PixelFormat shadeFormat;
+    ShadeCache* shade;
+
+    /* Event handling */
+    int needDraw;
+    int hidden;             /* fully covered, or unmapped */
+    int stale;              /* missed a timed redraw while unseen */
+    int resizeTimer;
+    int lastMouseX, lastMouseY;
+
+    /* Private to the modules that use them, made when first needed */
+    GC darksideGC;                  /* mooncalcs.c */
+    struct ImageState* image;       /* moonimage.c */
+    struct RenderState* render;     /* moonrender.c */
+    struct ShmState* shm;           /* moonshm.c */
+    struct AnimState* anim;         /* moonanim.c */
+    struct DeskState* desk;         /* moondesk.c: -root only */
+} MoonContext;
+
+/* mooncalcs.c */
+extern void PaintDarkside(MoonContext* ctx, Drawable d, int moonsize,
+                          time_t date);
+extern double GetPhaseAngle(time_t date);
+extern double GetIlluminatedFraction(time_t date);
+extern time_t NextFullMoon(time_t date);
+extern void GetSunDirection(time_t date, double sun[3]);
+
+/* moonrender.c */
+extern int PaintDarksideRender(MoonContext* ctx, Drawable d, int moonsize,
+                               time_t date);
+extern int CopyMoonRender(MoonContext* ctx, Drawable d, int moonsize,
+                          time_t date);
+extern void FreeRenderState(MoonContext* ctx);
+
+/* moonimage.c */
+extern int CreateMoonPixmaps(MoonContext* ctx, unsigned int diam,
+                             int useCache, Pixmap* pix, Pixmap* mask);
+extern void ReleaseMoonPixmaps(MoonContext* ctx, Pixmap pix);
+/* The moon as premultiplied ARGB, at any diameter. */
+extern const unsigned int* GetMoonARGB(MoonContext* ctx, unsigned int diam);
+extern void FreeImageState(MoonContext* ctx);
+extern int moonResamples;
+
+/* moonfile.c: images without an X server */
+extern int RenderMoonImage(MoonContext* ctx, time_t date, unsigned int* out);
+extern int WriteMoonImage(const char* path, const unsigned int* argb,
+                          unsigned int diam);
+/* How a drawn moon differs from a stored one */
+typedef struct {
+    unsigned long pixels;
+    unsigned long differing;    /* by more than the tolerance */
+    int maxDiff;                /* in any channel of any pixel */
+} ImageDiff;
+extern int CompareMoonImage(const char* path, const unsigned int* argb,
+                            unsigned int diam, int tolerance,
+                            ImageDiff* diff);
+extern int CompareShownImage(const char* path, const unsigned int* argb,
+                             unsigned int diam, int tolerance,
+                             ImageDiff* diff);
+extern int ExportFrames(const MoonContext* proto, const char* pattern,
+                        time_t start, long step, int nframes, int nthreads,
+                        double* writeWait);
+
+/* moonclock.c */
+extern int ParseClock(const char* spec, MoonClock* clk);
+extern time_t ClockNow(const MoonClock* clk);
+extern double ClockRate(const MoonClock* clk);
+extern time_t MoonTime(const MoonContext* ctx);
+
+/* moonanim.c */
+extern int StartAnimation(MoonContext* ctx, double secsPerLunation, int fps);
+extern void RestartAnimation(MoonContext* ctx, int fromNow);
+extern void PauseAnimation(MoonContext* ctx, int paused);
+extern void StopAnimation(MoonContext* ctx);
+
+/* moondesk.c: drawing on the root window */
+extern int InitDesk(MoonContext* ctx, int x, int y);
+extern int DrawsOnWallpaper(MoonContext* ctx);
+extern void PresentOnDesk(MoonContext* ctx, Drawable back, Pixmap mask);
+extern int HandleDeskEvent(MoonContext* ctx, XEvent* event);
+extern void FreeDeskState(MoonContext* ctx);
+
+/* moonshm.c */
+extern XImage* CreateShadeImage(MoonContext* ctx);
+extern void DestroyShadeImage(MoonContext* ctx, XImage* img);
+extern void PrepareShadeImage(MoonContext* ctx, XImage* img);
+extern void PutShadeImage(MoonContext* ctx, Drawable d, XImage* img);
+extern int IsShmImage(MoonContext* ctx, XImage* img);
+extern int HandleShmEvent(MoonContext* ctx, XEvent* event);
+extern void FreeShmState(MoonContext* ctx);
+
+/* moonloop.c */
+typedef void (*WatchProc)(int fd, void* data);
+extern int WatchFd(int fd, WatchProc proc, void* data);
+extern void UnwatchFd(int fd);
+extern void SetPrepareProc(WatchProc proc, void* data);
+extern int CreateTimer(WatchProc proc, void* data);
+extern void SetTimer(int fd, unsigned long ms, unsigned long interval);
+extern void SetTimerUs(int fd, unsigned long us, unsigned long interval);
+extern unsigned long ReadTimer(int fd);
+extern int WatchSignals(const int* sigs, WatchProc proc, void* data);
+extern void QuitLoop();
+extern int RunLoop();
+extern void CloseLoop();
+extern unsigned long loopWakeups;
 
-extern Display* dpy;
-extern int screen;
-extern Window win;
-extern GC gc;
+/* mooncontrol.c: proc answers one command line, into reply */
+typedef void (*ControlProc)(const char* line, char* reply, size_t len,
+                            void* data);
+extern void DefaultControlPath(const char* display, char* path, size_t len);
+extern int StartControl(const char* path, ControlProc proc, void* data);
+extern void StopControl();
 
-extern int XWinSize;
-extern int YWinSize;
+/* moonstats.c: process-wide */
+#define STAT_DRAW_US        0
+#define STAT_DRAW_REQUESTS  1
+#define STAT_PHASE_US       2
+#define STAT_DARKSIDE_US    3
+#define STAT_FRAME_LATE_US  4
+#define STAT_FRAMES_DROPPED 5
+#define NUM_STATS           6
+extern double StatsClock();
+extern void StartStats();
+extern void StatsRecord(int which, double value);
+extern void StatsCountEvent(int type);
+extern void DumpStats(FILE* fp);
 
-extern void PaintDarkside(int moonsize, time_t date);
+/* moontrace.c: per display */
+extern void StartTrace(Display* d, int sync);
+extern void TraceBegin(Display* d, const char* what);
+extern void TraceRoundTrip(Display* d, const char* call);
+extern void TraceEnd(Display* d);
 
+#endif /* MOONROOT_H */
@@ -0,0 +1,552 @@
+/*
+ * moonshade.c: shade the moon on the CPU, a pixel at a time.
+ *
+ * Each pixel's brightness comes from the Lambert cosine between the
+ * sphere's surface normal there and the direction of the sun,
+ * smoothed across the terminator and never dropping below an
+ * earthshine floor.  The normals only depend on the moon's diameter,
+ * so they're computed once per size and kept in a ShadeCache.
+ * Each renderer has its own cache, so they can shade in parallel.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+#include "moonpixel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Half-width of the terminator's soft edge, as a cosine. */
+#define TERMINATOR_SOFTNESS 0.03f
+
+struct ShadeCache {
+    /* The normal map.  x and y components depend only on the column
+     * and the row, so only z needs storing per pixel.
+     * Outside the disc the normal is (x, y, 0).
+     */
+    float* normalX;
+    float* normalY;
+    float* normalZ;
+    unsigned int normalDiam;
+
+    /* Coverage, one byte per pixel, for the exact edges */
+    unsigned char* litCoverage;
+    unsigned char* discCoverage;
+    unsigned char* darkCoverage;
+    unsigned int coverageDiam;
+
+    /* The moon for ShadeMoonAA, opaque out to the edge of the disc */
+    unsigned int* solid;
+    const unsigned int* solidSource;
+    unsigned int solidDiam;
+};
+
+ShadeCache* NewShadeCache()
+{
+    return calloc(1, sizeof (ShadeCache));
+}
+
+void FreeShadeCache(ShadeCache* sc)
+{
+    if (!sc)
+        return;
+    free(sc->normalX);
+    free(sc->normalY);
+    free(sc->normalZ);
+    free(sc->litCoverage);
+    free(sc->discCoverage);
+    free(sc->darkCoverage);
+    free(sc->solid);
+    free(sc);
+}
+
+static int MakeNormalMap(ShadeCache* sc, unsigned int diam)
+{
+    float radius = diam / 2.f;
+    unsigned int x, y;
+
+    if (sc->normalZ && sc->normalDiam == diam)
+        return 0;
+
+    free(sc->normalX);
+    free(sc->normalY);
+    free(sc->normalZ);
+    sc->normalX = malloc(diam * sizeof *sc->normalX);
+    sc->normalY = malloc(diam * sizeof *sc->normalY);
+    sc->normalZ = malloc(diam * diam * sizeof *sc->normalZ);
+    sc->normalDiam = diam;
+    if (!sc->normalX || !sc->normalY || !sc->normalZ)
+    {
+        sc->normalDiam = 0;
+        return -1;
+    }
+
+    for (x = 0; x < diam; ++x)
+        sc->normalX[x] = sc->normalY[x] = (x + .5f - radius) / radius;
+    for (y = 0; y < diam; ++y)
+        for (x = 0; x < diam; ++x)
+        {
+            float zz = 1.f - sc->normalX[x]*sc->normalX[x]
+                           - sc->normalY[y]*sc->normalY[y];
+            sc->normalZ[y*diam + x] = zz > 0.f ? sqrtf(zz) : 0.f;
+        }
+    return 0;
+}
+
+/* Brightness, 0 to 256, from the cosine of the sun angle:
+ * a smoothstep across the terminator, lifted to the earthshine floor.
+ * t is the cosine already mapped so the terminator runs 0 to 256.
+ * Works on single ints or on whole vectors of them.
+ */
+#define BRIGHTNESS(t, lowest) \
+    ((lowest) + (((256 - (lowest)) * ((t) * (t) * (768 - 2*(t)) >> 16)) >> 8))
+
+/* Clamp a vector of ints to 0..256 (vector compares give -1 for true). */
+#define CLAMP_256(t) \
+    (((t) & ~((t) < 0) & ~((t) > 256)) | (256 & ((t) > 256)))
+
+/* Shade a premultiplied ARGB moon of the given diameter for a sun
+ * in direction sun[] (see GetSunDirection), writing native pixels
+ * in format pf to out.  earthshine is the brightness, 0 to 1,
+ * of the dark side.  If pf has alpha, it's the image's own.
+ */
+void ShadeMoon(ShadeCache* sc, const unsigned int* argb, unsigned int diam,
+               const double sun[3], double earthshine,
+               const PixelFormat* pf, unsigned int* out)
+{
+    float sx = sun[0], sy = sun[1], sz = sun[2];
+    float scale = 256.f / (2.f * TERMINATOR_SOFTNESS);
+    int lowest = (int)(earthshine * 256. + .5);
+    const float* normalX;
+    unsigned int x, y;
+
+    if (MakeNormalMap(sc, diam) != 0)
+        return;
+    normalX = sc->normalX;
+    if (lowest < 0)
+        lowest = 0;
+    if (lowest > 256)
+        lowest = 256;
+
+    for (y = 0; y < diam; ++y)
+    {
+        const unsigned int* in = argb + y*diam;
+        const float* nz = sc->normalZ + y*diam;
+        unsigned int* o = out + y*diam;
+        /* the y term, and the shift that puts the terminator at 128 */
+        float rowterm = sc->normalY[y] * sy + TERMINATOR_SOFTNESS;
+
+        x = 0;
+#ifdef USE_VECTORS
+        for ( ; x + 16 <= diam; x += 16)
+        {
+            v16f nx16, nz16;
+            v16i t;
+            v16u a, p;
+
+            memcpy(&nx16, normalX + x, sizeof nx16);
+            memcpy(&nz16, nz + x, sizeof nz16);
+            t = __builtin_convertvector(
+                    (nx16*sx + nz16*sz + rowterm) * scale, v16i);
+            t = CLAMP_256(t);
+            t = BRIGHTNESS(t, lowest);
+            memcpy(&a, in + x, sizeof a);
+            p = SCALE_PIXEL(a, (v16u)t);
+            p = PACK_PIXEL((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff, pf);
+            if (pf->ashift >= 0)
+                p |= (a >> 24) << pf->ashift;
+            memcpy(o + x, &p, sizeof p);
+        }
+#endif
+        for ( ; x < diam; ++x)
+        {
+            int t = (int)((normalX[x]*sx + nz[x]*sz + rowterm) * scale);
+            unsigned int p;
+
+            t = t < 0 ? 0 : t > 256 ? 256 : t;
+            t = BRIGHTNESS(t, lowest);
+            p = SCALE_PIXEL(in[x], (unsigned int)t);
+            o[x] = PACK_PIXEL((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff, pf);
+            if (pf->ashift >= 0)
+                o[x] |= (in[x] >> 24) << pf->ashift;
+        }
+    }
+}
+
+/*
+ * Anti-aliased edges by exact coverage.
+ *
+ * Seen from Earth, the lit part of the moon on the scanline at height v
+ * runs from cl*h(v) to cr*h(v), where h(v) = sqrt(r^2 - v^2) is the
+ * half-width of the disc there: the limb is c = +-1 and the terminator,
+ * half of an ellipse, is c = -+cos(phase angle).  So the area of a
+ * pixel covered by lit moon is a difference of two integrals of
+ * clamp(c * h(v)), which have closed forms in v and asin(v).
+ * Only pixels that an edge actually passes through need them:
+ * the rest of each row is filled as plain spans.
+ */
+
+/* Antiderivative of h(v). */
+static double HalfWidthIntegral(double r, double v)
+{
+    double s = v / r;
+
+    if (s > 1.)
+        s = 1.;
+    if (s < -1.)
+        s = -1.;
+    return .5 * (v * sqrt(r*r - v*v > 0. ? r*r - v*v : 0.) + r*r * asin(s));
+}
+
+/* Integral over v from y0 to y1 of clamp(c*h(v), x0, x1) - x0,
+ * with -r <= y0 <= y1 <= r.
+ */
+static double ClampedIntegral(double c, double r,
+                              double x0, double x1, double y0, double y1)
+{
+    double breaks[7];
+    double xs[2];
+    double area = 0.;
+    int nbreaks = 0;
+    int i, j;
+
+    breaks[nbreaks++] = y0;
+    if (y0 < 0. && y1 > 0.)
+        breaks[nbreaks++] = 0.;
+
+    /* Where c*h(v) crosses the pixel's sides, h being monotonic
+     * on each side of v = 0.
+     */
+    xs[0] = x0;
+    xs[1] = x1;
+    for (i = 0; i < 2 && c != 0.; ++i)
+    {
+        double hv = xs[i] / c;
+        double v;
+
+        if (hv < 0. || hv > r)
+            continue;
+        v = sqrt(r*r - hv*hv);
+        if (v > y0 && v < y1)
+            breaks[nbreaks++] = v;
+        if (-v > y0 && -v < y1 && v != 0.)
+            breaks[nbreaks++] = -v;
+    }
+    breaks[nbreaks++] = y1;
+
+    /* Sort: there are only a handful. */
+    for (i = 1; i < nbreaks; ++i)
+        for (j = i; j > 0 && breaks[j] < breaks[j-1]; --j)
+        {
+            double t = breaks[j];
+            breaks[j] = breaks[j-1];
+            breaks[j-1] = t;
+        }
+
+    for (i = 0; i + 1 < nbreaks; ++i)
+    {
+        double a = breaks[i], b = breaks[i+1];
+        double mid = (a + b) / 2.;
+        double f = c * sqrt(r*r - mid*mid > 0. ? r*r - mid*mid : 0.);
+
+        if (b <= a || f <= x0)
+            continue;
+        if (f >= x1)
+            area += (x1 - x0) * (b - a);
+        else
+            area += c * (HalfWidthIntegral(r, b) - HalfWidthIntegral(r, a))
+                    - x0 * (b - a);
+    }
+    return area;
+}
+
+/* Rasterize the part of the disc between cl*h(v) and cr*h(v)
+ * (-1 <= cl <= cr <= 1) as coverage, 0 to 255, one byte per pixel.
+ * Returns how many pixels needed an exact computation.
+ */
+static int RasterizeCoverage(unsigned int diam, double cl, double cr,
+                             unsigned char* cov)
+{
+    double r = diam / 2.;
+    int exact = 0;
+    unsigned int i, j;
+
+    memset(cov, 0, diam * diam);
+    if (cr <= cl)
+        return 0;
+
+    for (j = 0; j < diam; ++j)
+    {
+        unsigned char* row = cov + j*diam;
+        double y0 = j - r, y1 = j + 1 - r;
+        double hnear, hfar, la, lb, ra, rb, height;
+        int span0, span1, ilo, ihi;
+
+        if (y0 < -r)
+            y0 = -r;
+        if (y1 > r)
+            y1 = r;
+        height = y1 - y0;
+        if (height <= 0.)
+            continue;
+
+        /* Extremes of h over the row, then of each edge */
+        hnear = (y0 < 0. && y1 > 0.) ? r
+            : sqrt(r*r - (fabs(y0) < fabs(y1) ? y0*y0 : y1*y1));
+        hfar = sqrt(r*r - (fabs(y0) > fabs(y1) ? y0*y0 : y1*y1));
+        la = cl < 0. ? cl * hnear : cl * hfar;
+        lb = cl < 0. ? cl * hfar : cl * hnear;
+        ra = cr < 0. ? cr * hnear : cr * hfar;
+        rb = cr < 0. ? cr * hfar : cr * hnear;
+
+        /* Pixels wholly between the edges, and everything touched */
+        span0 = (int)ceil(lb + r);
+        span1 = (int)floor(ra + r);
+        ilo = (int)floor(la + r);
+        ihi = (int)ceil(rb + r);
+        if (ilo < 0)
+            ilo = 0;
+        if (ihi > (int)diam)
+            ihi = diam;
+
+        if (span1 > span0)
+            memset(row + span0, (int)(height * 255. + .5), span1 - span0);
+        else
+            span0 = span1 = ihi;
+
+        for (i = ilo; (int)i < ihi; ++i)
+        {
+            double x0 = i - r, x1 = i + 1 - r;
+            double area;
+
+            if ((int)i == span0)
+            {
+                i = span1 - 1;
+                continue;
+            }
+            area = ClampedIntegral(cr, r, x0, x1, y0, y1)
+                 - ClampedIntegral(cl, r, x0, x1, y0, y1);
+            row[i] = (unsigned char)(area * 255. + .5);
+            ++exact;
+        }
+    }
+    return exact;
+}
+
+/* Coverage of the disc (it doesn't change) and of its lit part. */
+static int MakeCoverage(ShadeCache* sc, unsigned int diam,
+                        const double sun[3])
+{
+    double cl, cr;
+
+    if (!sc->discCoverage || sc->coverageDiam != diam)
+    {
+        free(sc->litCoverage);
+        free(sc->discCoverage);
+        free(sc->darkCoverage);
+        sc->litCoverage = malloc(diam * diam);
+        sc->discCoverage = malloc(diam * diam);
+        sc->darkCoverage = malloc(diam * diam);
+        sc->coverageDiam = diam;
+        if (!sc->litCoverage || !sc->discCoverage || !sc->darkCoverage)
+        {
+            sc->coverageDiam = 0;
+            return -1;
+        }
+        RasterizeCoverage(diam, -1., 1., sc->discCoverage);
+    }
+
+    /* The terminator sits at -sun[2]*h(v) on the side away from the sun */
+    if (sun[0] >= 0.)
+    {
+        cl = -sun[2];
+        cr = 1.;
+    }
+    else
+    {
+        cl = -1.;
+        cr = sun[2];
+    }
+    RasterizeCoverage(diam, cl, cr, sc->litCoverage);
+    return 0;
+}
+
+/* Undo premultiplication: the colour of the moon in pixel p. */
+static unsigned int Unpremultiply(unsigned int p)
+{
+    unsigned int a = p >> 24, c, rgb = 0;
+    int shift;
+
+    for (shift = 0; shift < 24; shift += 8)
+    {
+        c = (((p >> shift) & 0xff) * 255 + a / 2) / a;
+        rgb |= (c > 255 ? 255 : c) << shift;
+    }
+    return 0xff000000 | rgb;
+}
+
+/* Too faint to take the colour from: the rounding shows */
+#define SOLID_ALPHA 0x40
+
+/* The moon image's own edge is already faded by its alpha, and cut
+ * off where the disc still covers part of a pixel: shading that by
+ * the coverage would darken the limb twice over.  So the colour is
+ * taken out of the alpha, and every pixel the disc touches that's
+ * too faint for that gets the colour of the nearest one towards the
+ * centre that isn't.  Then coverage alone fades the edge.
+ * Returns 0 on success.
+ */
+static int MakeSolidMoon(ShadeCache* sc, const unsigned int* argb,
+                         unsigned int diam)
+{
+    float centre = (diam - 1) / 2.f;
+    unsigned int x, y;
+
+    if (sc->solid && sc->solidSource == argb && sc->solidDiam == diam)
+        return 0;
+    free(sc->solid);
+    sc->solid = malloc(diam * diam * sizeof *sc->solid);
+    sc->solidSource = 0;
+    if (!sc->solid)
+        return -1;
+
+    for (y = 0; y < diam; ++y)
+        for (x = 0; x < diam; ++x)
+        {
+            unsigned int i = y*diam + x;
+            float dx = centre - x, dy = centre - y;
+            float len = sqrtf(dx*dx + dy*dy);
+            unsigned int p = argb[i];
+            int k;
+
+            sc->solid[i] = p;
+            if (p >> 24 == 0xff)
+                continue;
+            if (p >> 24 >= SOLID_ALPHA)
+            {
+                sc->solid[i] = Unpremultiply(p);
+                continue;
+            }
+            if (!sc->discCoverage[i] || len < 1.f)
+                continue;
+            dx /= len;
+            dy /= len;
+            for (k = 1; k <= (int)len; ++k)
+            {
+                unsigned int q = argb[(unsigned int)(y + k*dy + .5f) * diam
+                                      + (unsigned int)(x + k*dx + .5f)];
+                if (q >> 24 >= SOLID_ALPHA)
+                {
+                    sc->solid[i] = Unpremultiply(q);
+                    break;
+                }
+            }
+        }
+    sc->solidSource = argb;
+    sc->solidDiam = diam;
+    return 0;
+}
+
+/* Like ShadeMoon, but with exact anti-aliased terminator and limb:
+ * each pixel is lit in proportion to how much of it is lit moon,
+ * at earthshine in proportion to how much is dark moon.
+ * If pf has alpha, it's how much of the pixel is moon at all.
+ * (The terminator isn't tilted: the sun is taken to be in the
+ * plane of the sky's x axis, as GetSunDirection gives it.)
+ */
+void ShadeMoonAA(ShadeCache* sc, const unsigned int* argb,
+                 unsigned int diam, const double sun[3], double earthshine,
+                 const PixelFormat* pf, unsigned int* out)
+{
+    int lowest = (int)(earthshine * 256. + .5);
+    const unsigned char* litCoverage;
+    const unsigned char* discCoverage;
+    unsigned int i = 0;
+
+    if (MakeCoverage(sc, diam, sun) != 0
+        || MakeSolidMoon(sc, argb, diam) != 0)
+        return;
+    argb = sc->solid;
+    litCoverage = sc->litCoverage;
+    discCoverage = sc->discCoverage;
+    if (lowest < 0)
+        lowest = 0;
+    if (lowest > 256)
+        lowest = 256;
+
+    /* brightness = (lowest*disc + (256-lowest)*lit) / 255, 0 to 256 */
+#ifdef USE_VECTORS
+    for ( ; i + 16 <= diam * diam; i += 16)
+    {
+        v16b lit8, disc8;
+        v16u disc, b, p;
+
+        memcpy(&lit8, litCoverage + i, sizeof lit8);
+        memcpy(&disc8, discCoverage + i, sizeof disc8);
+        disc = __builtin_convertvector(disc8, v16u);
+        b = (lowest * disc
+             + (256 - lowest) * __builtin_convertvector(lit8, v16u)
+             + 127) / 255;
+        memcpy(&p, argb + i, sizeof p);
+        p = SCALE_PIXEL(p, b);
+        p = PACK_PIXEL((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff, pf);
+        if (pf->ashift >= 0)
+            p |= disc << pf->ashift;
+        memcpy(out + i, &p, sizeof p);
+    }
+#endif
+    for ( ; i < diam * diam; ++i)
+    {
+        unsigned int b = (lowest * discCoverage[i]
+                          + (256 - lowest) * litCoverage[i] + 127) / 255;
+        unsigned int p = SCALE_PIXEL(argb[i], b);
+        out[i] = PACK_PIXEL((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff, pf);
+        if (pf->ashift >= 0)
+            out[i] |= (unsigned int)discCoverage[i] << pf->ashift;
+    }
+}
+
+/* Coverage, 0 to 255, of the unlit part of the disc, one byte per
+ * pixel: the mask for darkening the moon on the X server.
+ * It stays valid until the next call with the same cache.
+ */
+const unsigned char* DarkCoverage(ShadeCache* sc, unsigned int diam,
+                                  const double sun[3])
+{
+    unsigned int i;
+
+    if (MakeCoverage(sc, diam, sun) != 0)
+        return 0;
+    for (i = 0; i < diam * diam; ++i)
+        sc->darkCoverage[i] = sc->discCoverage[i] > sc->litCoverage[i]
+                              ? sc->discCoverage[i] - sc->litCoverage[i] : 0;
+    return sc->darkCoverage;
+}
+
+/* XBM-style shape mask of every pixel the disc touches at all,
+ * so anti-aliased limb pixels aren't cut off.
+ */
+unsigned char* DiscMaskBits(unsigned int diam)
+{
+    unsigned int rowbytes = (diam + 7) / 8;
+    unsigned char* cov = malloc(diam * diam);
+    unsigned char* bits = calloc(rowbytes * diam, 1);
+    unsigned int x, y;
+
+    if (!cov || !bits)
+    {
+        free(cov);
+        free(bits);
+        return 0;
+    }
+    RasterizeCoverage(diam, -1., 1., cov);
+    for (y = 0; y < diam; ++y)
+        for (x = 0; x < diam; ++x)
+            if (cov[y*diam + x])
+                bits[y*rowbytes + x/8] |= 1 << (x%8);
+    free(cov);
+    return bits;
+}
@@ -0,0 +1,243 @@
+/*
+ * moonshm.c: get CPU-shaded moons to the X server.
+ *
+ * On a local display the image lives in a MIT-SHM segment that the
+ * server reads directly, so a redraw sends one small request instead
+ * of the whole image down the socket.  Remote displays, or servers
+ * without the extension, get a plain malloc'd XImage and XPutImage.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+#include "moonpixel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+
+/* A context's shared-memory image: there's only ever one at a time */
+struct ShmState {
+    int haveShm;
+    int completion;         /* event type of ShmCompletion */
+    XShmSegmentInfo info;
+    XImage* image;
+
+    /* Set while the server may still be reading the segment */
+    int busy;
+};
+
+/* Attach errors arrive through the error handler, which is
+ * process-wide and gets no context, so attaching is one display at a
+ * time, and errors from other displays meanwhile go to the handler
+ * that was there before.
+ */
+static pthread_mutex_t attachLock = PTHREAD_MUTEX_INITIALIZER;
+static Display* attaching;
+static int shmFailed;
+static int (*oldHandler)(Display*, XErrorEvent*);
+
+static int ShmErrorHandler(Display* d, XErrorEvent* err)
+{
+    if (d != attaching)
+        return oldHandler ? oldHandler(d, err) : 0;
+    shmFailed = 1;
+    return 0;
+}
+
+static struct ShmState* InitShm(MoonContext* ctx)
+{
+    struct ShmState* ss = calloc(1, sizeof *ss);
+
+    if (!ss)
+        return 0;
+    ctx->shm = ss;
+    if (!ctx->useShm)
+        return ss;
+    TraceRoundTrip(ctx->dpy, "XShmQueryExtension");
+    ss->haveShm = XShmQueryExtension(ctx->dpy);
+    if (ss->haveShm)
+        ss->completion = XShmGetEventBase(ctx->dpy) + ShmCompletion;
+    return ss;
+}
+
+/* Attach a segment of the given size to the server, or return -1:
+ * the extension can be there but unusable, e.g. over the network.
+ */
+static int AttachSegment(MoonContext* ctx, struct ShmState* ss, size_t size)
+{
+    Display* dpy = ctx->dpy;
+    int failed;
+
+    ss->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (ss->info.shmid < 0)
+        return -1;
+    ss->info.shmaddr = shmat(ss->info.shmid, 0, 0);
+    if (ss->info.shmaddr == (char*)-1)
+    {
+        shmctl(ss->info.shmid, IPC_RMID, 0);
+        return -1;
+    }
+    ss->info.readOnly = True;
+
+    TraceRoundTrip(dpy, "XSync");
+    XSync(dpy, False);
+    pthread_mutex_lock(&attachLock);
+    attaching = dpy;
+    shmFailed = 0;
+    oldHandler = XSetErrorHandler(ShmErrorHandler);
+    XShmAttach(dpy, &ss->info);
+    TraceRoundTrip(dpy, "XSync");
+    XSync(dpy, False);
+    XSetErrorHandler(oldHandler);
+    failed = shmFailed;
+    attaching = 0;
+    pthread_mutex_unlock(&attachLock);
+
+    /* Either way, the segment goes away when the last user detaches */
+    shmctl(ss->info.shmid, IPC_RMID, 0);
+    if (failed)
+    {
+        shmdt(ss->info.shmaddr);
+        return -1;
+    }
+    return 0;
+}
+
+static XImage* CreateShmImage(MoonContext* ctx, struct ShmState* ss)
+{
+    XImage* img = XShmCreateImage(ctx->dpy, ctx->visual, ctx->depth,
+                                  ZPixmap, 0, &ss->info,
+                                  ctx->diam, ctx->diam);
+    if (!img)
+        return 0;
+    if (AttachSegment(ctx, ss, (size_t)img->bytes_per_line * ctx->diam) != 0)
+    {
+        XDestroyImage(img);
+        ss->haveShm = 0;
+        return 0;
+    }
+    img->data = ss->info.shmaddr;
+    ss->image = img;
+    return img;
+}
+
+/* An XImage of the context's size and visual for ShadeMoon to fill.
+ * Returns 0 if there's no such thing.
+ */
+XImage* CreateShadeImage(MoonContext* ctx)
+{
+    struct ShmState* ss = ctx->shm;
+    XImage* img;
+
+    if (!ss && !(ss = InitShm(ctx)))
+        return 0;
+    if (ss->haveShm && !ss->image && (img = CreateShmImage(ctx, ss)) != 0)
+        return img;
+
+    img = XCreateImage(ctx->dpy, ctx->visual, ctx->depth, ZPixmap, 0, 0,
+                       ctx->diam, ctx->diam, 32, 0);
+    if (!img)
+        return 0;
+    if (!(img->data = malloc((size_t)img->bytes_per_line * ctx->diam)))
+    {
+        XDestroyImage(img);
+        return 0;
+    }
+    return img;
+}
+
+/* Is this the completion for ss's segment?  Several windows on one
+ * display each have their own segment.
+ */
+static int IsOurCompletion(struct ShmState* ss, XEvent* event)
+{
+    return event->type == ss->completion
+        && ((XShmCompletionEvent*)event)->shmseg == ss->info.shmseg;
+}
+
+static Bool IsCompletion(Display* d, XEvent* event, XPointer arg)
+{
+    return IsOurCompletion((struct ShmState*)arg, event);
+}
+
+/* Block until the server is done reading the shared image,
+ * leaving any other events queued for HandleEvent.
+ */
+static void WaitForShm(MoonContext* ctx, struct ShmState* ss)
+{
+    XEvent event;
+
+    if (ss->busy)
+    {
+        TraceRoundTrip(ctx->dpy, "ShmCompletion");
+        XIfEvent(ctx->dpy, &event, IsCompletion, (XPointer)ss);
+        ss->busy = 0;
+    }
+}
+
+void DestroyShadeImage(MoonContext* ctx, XImage* img)
+{
+    struct ShmState* ss = ctx->shm;
+
+    if (ss && img == ss->image)
+    {
+        WaitForShm(ctx, ss);
+        XShmDetach(ctx->dpy, &ss->info);
+        TraceRoundTrip(ctx->dpy, "XSync");
+        XSync(ctx->dpy, False);
+        img->data = 0;
+        XDestroyImage(img);
+        shmdt(ss->info.shmaddr);
+        ss->image = 0;
+        return;
+    }
+    XDestroyImage(img);
+}
+
+/* Wait until the image's memory is free to be written. */
+void PrepareShadeImage(MoonContext* ctx, XImage* img)
+{
+    if (IsShmImage(ctx, img))
+        WaitForShm(ctx, ctx->shm);
+}
+
+void PutShadeImage(MoonContext* ctx, Drawable d, XImage* img)
+{
+    if (IsShmImage(ctx, img))
+    {
+        XShmPutImage(ctx->dpy, d, ctx->gc, img, 0, 0, 0, 0,
+                     img->width, img->height, True);
+        ctx->shm->busy = 1;
+    }
+    else
+        XPutImage(ctx->dpy, d, ctx->gc, img, 0, 0, 0, 0,
+                  img->width, img->height);
+}
+
+int IsShmImage(MoonContext* ctx, XImage* img)
+{
+    return img && ctx->shm && img == ctx->shm->image;
+}
+
+/* Returns 1 if the event was ours. */
+int HandleShmEvent(MoonContext* ctx, XEvent* event)
+{
+    struct ShmState* ss = ctx->shm;
+
+    if (!ss || !ss->haveShm || !IsOurCompletion(ss, event))
+        return 0;
+    ss->busy = 0;
+    return 1;
+}
+
+/* Call after the shade image is destroyed. */
+void FreeShmState(MoonContext* ctx)
+{
+    free(ctx->shm);
+    ctx->shm = 0;
+}
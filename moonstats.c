@@ -0,0 +1,138 @@
+/*
+ * moonstats.c: counters and histograms of what moonroot costs.
+ *
+ * Always on: recording a value is a few additions, and timing one
+ * is two clock_gettime calls, which don't enter the kernel, and an
+ * uncontended lock, since every display's thread records here.
+ * kill -USR1 dumps the lot.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Bucket i counts values from 2^(i-1) up to 2^i; bucket 0 is below 1 */
+#define STAT_BUCKETS 32
+
+typedef struct {
+    const char* name;
+    unsigned long count;
+    double total, max;
+    unsigned long buckets[STAT_BUCKETS];
+} Histogram;
+
+static Histogram histograms[NUM_STATS] = {
+    { "Draw, us", 0, 0., 0., { 0 } },
+    { "X requests per Draw", 0, 0., 0., { 0 } },
+    { "GetPhaseAngle, us", 0, 0., 0., { 0 } },
+    { "PaintDarkside, us", 0, 0., 0., { 0 } },
+    { "Animation frame lateness, us", 0, 0., 0., { 0 } },
+    { "Frames dropped before each shown", 0, 0., 0., { 0 } },
+};
+
+static unsigned long events[LASTEvent];
+
+static double startTime = -1.;
+
+/* Called once, as moonroot starts: the hours in DumpStats count from here */
+void StartStats()
+{
+    startTime = StatsClock();
+}
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+double StatsClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void StatsRecord(int which, double value)
+{
+    Histogram* h = &histograms[which];
+    int bucket = 0;
+
+    while (bucket < STAT_BUCKETS - 1 && value >= (double)(1UL << bucket))
+        ++bucket;
+
+    pthread_mutex_lock(&statsLock);
+    ++h->count;
+    h->total += value;
+    if (value > h->max)
+        h->max = value;
+    ++h->buckets[bucket];
+    pthread_mutex_unlock(&statsLock);
+}
+
+void StatsCountEvent(int type)
+{
+    if (type >= 0 && type < LASTEvent)
+        __atomic_add_fetch(&events[type], 1, __ATOMIC_RELAXED);
+}
+
+static const char* EventName(int type)
+{
+    switch (type)
+    {
+        case KeyPress:        return "KeyPress";
+        case ButtonPress:     return "ButtonPress";
+        case ButtonRelease:   return "ButtonRelease";
+        case MotionNotify:    return "MotionNotify";
+        case Expose:          return "Expose";
+        case NoExpose:        return "NoExpose";
+        case VisibilityNotify: return "VisibilityNotify";
+        case UnmapNotify:     return "UnmapNotify";
+        case MapNotify:       return "MapNotify";
+        case ReparentNotify:  return "ReparentNotify";
+        case ConfigureNotify: return "ConfigureNotify";
+        case MappingNotify:   return "MappingNotify";
+        default:              return 0;
+    }
+}
+
+void DumpStats(FILE* fp)
+{
+    double hours;
+    int i, b;
+
+    pthread_mutex_lock(&statsLock);
+    hours = startTime < 0. ? 0. : (StatsClock() - startTime) / 3600e6;
+    fprintf(fp, "moonroot stats over %.2f hours\n", hours);
+    fprintf(fp, "wakeups: %lu (%.1f per hour)\n", loopWakeups,
+            hours > 0. ? loopWakeups / hours : 0.);
+
+    fprintf(fp, "events:");
+    for (i = 0; i < LASTEvent; ++i)
+        if (events[i])
+        {
+            const char* name = EventName(i);
+            if (name)
+                fprintf(fp, " %s %lu", name, events[i]);
+            else
+                fprintf(fp, " type%d %lu", i, events[i]);
+        }
+    fprintf(fp, "\n");
+
+    for (i = 0; i < NUM_STATS; ++i)
+    {
+        Histogram* h = &histograms[i];
+
+        fprintf(fp, "%s: count %lu", h->name, h->count);
+        if (h->count)
+            fprintf(fp, ", mean %.1f, max %.1f",
+                    h->total / h->count, h->max);
+        fprintf(fp, "\n");
+        for (b = 0; b < STAT_BUCKETS; ++b)
+            if (h->buckets[b])
+                fprintf(fp, "    < %-10lu %lu\n", 1UL << b, h->buckets[b]);
+    }
+    pthread_mutex_unlock(&statsLock);
+    fflush(fp);
+}
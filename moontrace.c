@@ -0,0 +1,146 @@
+/*
+ * moontrace.c: -trace-x, an account of the X traffic for each frame.
+ *
+ * For each traced stretch (startup, or one Draw) it logs how many
+ * requests went out (from NextRequest), how many bytes and flushes
+ * (from an Xlib before-flush hook), and which calls waited for a
+ * reply.  Xlib has no hook for replies, so round trips are counted
+ * only where we make calls that need one and say so: see
+ * TraceRoundTrip.  A call we haven't annotated, or one Xlib makes for
+ * itself, isn't counted, and the log says "annotated" to keep that in
+ * view.
+ *
+ * With -trace-sync the display is synchronous, so every request is a
+ * round trip, and a frame's time is what it costs over the wire; the
+ * annotated count still names only the calls that wait for a reply.
+ *
+ * The counts belong to the connection, so they hang off the Display,
+ * on its extension data list; displays that aren't traced cost a
+ * lookup that finds nothing.
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include "moonroot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlibint.h>
+
+#define MAX_CALLS 200
+
+typedef struct {
+    XExtData data;          /* on the display's extension list */
+    const char* what;
+    unsigned long frame;
+    unsigned long firstRequest;
+    double startTime;
+    unsigned long bytesSent, flushes, roundTrips;
+    char calls[MAX_CALLS];
+} TraceState;
+
+static int FreeTrace(XExtData* ext)
+{
+    /* Nothing to do: the TraceState starts with the XExtData,
+     * which Xlib frees when the display closes.
+     */
+    return 0;
+}
+
+/* Our entry on the display's extension list: it's the one whose
+ * free_private is FreeTrace.
+ */
+static TraceState* FindTrace(Display* d)
+{
+    XExtData* ext = *XEHeadOfExtensionList((XEDataObject)d);
+
+    for ( ; ext; ext = ext->next)
+        if (ext->free_private == FreeTrace)
+            return (TraceState*)ext;
+    return 0;
+}
+
+static void BeforeFlush(Display* d, XExtCodes* codes,
+                        _Xconst char* data, long len)
+{
+    TraceState* ts = FindTrace(d);
+
+    if (ts)
+    {
+        ts->bytesSent += len;
+        ++ts->flushes;
+    }
+}
+
+/* Set up tracing on d; with sync, make every request synchronous. */
+void StartTrace(Display* d, int sync)
+{
+    XExtCodes* codes;
+    TraceState* ts;
+
+    if (FindTrace(d))
+        return;
+    codes = XAddExtension(d);
+    ts = calloc(1, sizeof *ts);
+    if (!codes || !ts)
+    {
+        free(ts);
+        return;
+    }
+    ts->data.number = codes->extension;
+    ts->data.free_private = FreeTrace;
+    XAddToExtensionList(XEHeadOfExtensionList((XEDataObject)d), &ts->data);
+    XESetBeforeFlush(d, codes->extension, BeforeFlush);
+    if (sync)
+        XSynchronize(d, True);
+}
+
+/* Start accounting for a stretch of drawing called what. */
+void TraceBegin(Display* d, const char* what)
+{
+    TraceState* ts = FindTrace(d);
+
+    if (!ts)
+        return;
+    ts->what = what;
+    ts->firstRequest = NextRequest(d);
+    ts->bytesSent = ts->flushes = ts->roundTrips = 0;
+    ts->calls[0] = '\0';
+    ts->startTime = StatsClock();
+}
+
+/* Note a call that waits for the server to reply. */
+void TraceRoundTrip(Display* d, const char* call)
+{
+    TraceState* ts = FindTrace(d);
+    size_t len;
+
+    if (!ts || !ts->what)
+        return;
+    ++ts->roundTrips;
+    len = strlen(ts->calls);
+    if (len + strlen(call) + 2 < sizeof ts->calls)
+        snprintf(ts->calls + len, sizeof ts->calls - len, " %s", call);
+}
+
+/* Log what the stretch since TraceBegin cost. */
+void TraceEnd(Display* d)
+{
+    TraceState* ts = FindTrace(d);
+
+    if (!ts || !ts->what)
+        return;
+
+    /* Push out what's still buffered, so its bytes are counted here */
+    XFlush(d);
+    fprintf(stderr, "%s %lu: %lu requests, %lu annotated round trips%s%s%s, "
+            "%lu bytes in %lu flushes, %.3f ms\n",
+            ts->what, ts->frame++, NextRequest(d) - ts->firstRequest,
+            ts->roundTrips, ts->roundTrips ? " (" : "",
+            ts->roundTrips ? ts->calls + 1 : "",
+            ts->roundTrips ? ")" : "", ts->bytesSent, ts->flushes,
+            (StatsClock() - ts->startTime) / 1e3);
+    ts->what = 0;
+}
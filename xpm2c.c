@@ -0,0 +1,217 @@
+/*
+ * xpm2c.c: convert an XPM image into a pre-decoded C image for moonroot.
+ *
+ * Runs at build time, so moonroot never has to parse XPM text
+ * (or link against libXpm) at startup.  The output is a C header with
+ *   <name>Width, <name>Height
+ *   <name>_pixels: one 0x00RRGGBB word per pixel, row by row
+ *   <name>_mask:   1-bit shape mask in XBM layout (LSB first,
+ *                  rows padded to whole bytes), 1 = opaque
+ * where <name> is the XPM's array name minus any "_xpm" suffix.
+ *
+ * Usage: xpm2c file.xpm > file_img.h
+ *
+ * Copyright 2004 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAXSTRINGS 4096
+
+static char* progname = "xpm2c";
+
+static void Die(char* msg, char* arg)
+{
+    fprintf(stderr, "%s: %s%s\n", progname, msg, arg ? arg : "");
+    exit(1);
+}
+
+/* Read the whole file into memory. */
+static char* ReadFile(char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    char* buf;
+    long len;
+
+    if (!fp)
+        Die("Can't open ", filename);
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    buf = malloc(len + 1);
+    if (!buf || fread(buf, 1, len, fp) != (size_t)len)
+        Die("Can't read ", filename);
+    buf[len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+/* Pull the array name and all the string literals out of the XPM source.
+ * The strings are unescaped in place.
+ */
+static int ParseXPM(char* src, char* name, int namelen, char** strings)
+{
+    char* s = strstr(src, "char");
+    char* d;
+    int nstrings = 0;
+    int i;
+
+    if (!s)
+        Die("Not an XPM file", 0);
+    s += 4;
+    while (*s && (isspace(*s) || *s == '*'))
+        ++s;
+    for (i = 0; i < namelen-1 && (isalnum(s[i]) || s[i] == '_'); ++i)
+        name[i] = s[i];
+    name[i] = '\0';
+
+    while ((s = strchr(s, '"')) != 0)
+    {
+        if (nstrings >= MAXSTRINGS)
+            Die("Too many strings", 0);
+        strings[nstrings++] = d = ++s;
+        while (*s && *s != '"')
+        {
+            if (*s == '\\' && s[1])
+                ++s;
+            *d++ = *s++;
+        }
+        if (!*s)
+            Die("Unterminated string", 0);
+        ++s;
+        *d = '\0';
+    }
+    return nstrings;
+}
+
+/* Parse an XPM colour spec.  Returns -1 for "None" (transparent). */
+static long ParseColor(char* spec)
+{
+    char* c = spec;
+    unsigned int r, g, b;
+
+    /* Find the "c" (colour visual) key. */
+    while (*c)
+    {
+        while (isspace(*c))
+            ++c;
+        if (c[0] == 'c' && isspace(c[1]))
+            break;
+        while (*c && !isspace(*c))
+            ++c;
+    }
+    if (!*c)
+        Die("No colour key in ", spec);
+    c += 2;
+    while (isspace(*c))
+        ++c;
+
+    if (!strncmp(c, "None", 4) || !strncmp(c, "none", 4))
+        return -1;
+    if (*c == '#' && sscanf(c+1, "%2x%2x%2x", &r, &g, &b) == 3
+        && strspn(c+1, "0123456789abcdefABCDEF") == 6)
+        return (r << 16) | (g << 8) | b;
+    if (*c == '#' && sscanf(c+1, "%1x%1x%1x", &r, &g, &b) == 3)
+        return (r * 0x11 << 16) | (g * 0x11 << 8) | b * 0x11;
+    if (!strncmp(c, "black", 5))
+        return 0;
+    if (!strncmp(c, "white", 5))
+        return 0xffffff;
+    Die("Unsupported colour: ", c);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char* src;
+    char name[256];
+    static char* strings[MAXSTRINGS];
+    int nstrings;
+    int width, height, ncolors, cpp;
+    char** keys;
+    long* colors;
+    int x, y, i;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s file.xpm\n", progname);
+        exit(1);
+    }
+
+    src = ReadFile(argv[1]);
+    nstrings = ParseXPM(src, name, sizeof name, strings);
+    if (nstrings < 1
+        || sscanf(strings[0], "%d %d %d %d",
+                  &width, &height, &ncolors, &cpp) != 4)
+        Die("Bad XPM header in ", argv[1]);
+    if (nstrings < 1 + ncolors + height)
+        Die("Truncated XPM: ", argv[1]);
+
+    /* Strip the conventional _xpm suffix from the array name */
+    i = strlen(name);
+    if (i > 4 && !strcmp(name + i - 4, "_xpm"))
+        name[i-4] = '\0';
+
+    keys = malloc(ncolors * sizeof(char*));
+    colors = malloc(ncolors * sizeof(long));
+    for (i = 0; i < ncolors; ++i)
+    {
+        keys[i] = strings[1+i];
+        if (strlen(keys[i]) < (size_t)cpp)
+            Die("Bad colour line: ", keys[i]);
+        colors[i] = ParseColor(keys[i] + cpp);
+    }
+
+    printf("/* Generated from %s by xpm2c: do not edit. */\n\n", argv[1]);
+    printf("static const unsigned int %sWidth = %d;\n", name, width);
+    printf("static const unsigned int %sHeight = %d;\n\n", name, height);
+
+    printf("static const unsigned int %s_pixels[] = {\n", name);
+    for (y = 0; y < height; ++y)
+    {
+        char* row = strings[1 + ncolors + y];
+        if (strlen(row) < (size_t)(width * cpp))
+            Die("Short pixel row: ", row);
+        for (x = 0; x < width; ++x)
+        {
+            long pixel = 0;
+            for (i = 0; i < ncolors; ++i)
+                if (!strncmp(row + x*cpp, keys[i], cpp))
+                {
+                    pixel = colors[i] < 0 ? 0 : colors[i];
+                    break;
+                }
+            if (i >= ncolors)
+                Die("Unknown pixel in row: ", row);
+            printf("%s0x%06lx,", (x % 8) ? " " : "\n    ", pixel);
+        }
+    }
+    printf("\n};\n\n");
+
+    printf("static const unsigned char %s_mask[] = {", name);
+    for (y = 0; y < height; ++y)
+    {
+        char* row = strings[1 + ncolors + y];
+        for (x = 0; x < width; x += 8)
+        {
+            int bits = 0;
+            int b;
+            for (b = 0; b < 8 && x+b < width; ++b)
+            {
+                for (i = 0; i < ncolors; ++i)
+                    if (!strncmp(row + (x+b)*cpp, keys[i], cpp))
+                        break;
+                if (colors[i] >= 0)
+                    bits |= 1 << b;
+            }
+            printf("%s0x%02x,", (x % 96) ? " " : "\n    ", bits);
+        }
+    }
+    printf("\n};\n");
+
+    return 0;
+}